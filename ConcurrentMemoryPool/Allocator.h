@@ -0,0 +1,77 @@
+#pragma once
+
+#include "ConcurrentAllocate.h"
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+// 让标准库容器直接使用内存池:
+//   std::map<int, int, std::less<int>, cmpool::allocator<std::pair<const int, int>>> m;
+//   std::pmr::list<int> l(cmpool::get_pool_resource());
+// 两者都没有状态，所有实例都相等，释放时带上大小，小对象不需要查基数树
+namespace cmpool {
+
+// 0 字节按 1 字节申请，释放时按同样的规则换算
+inline void* allocate_bytes(size_t bytes, size_t align) {
+    return concurrent_allocate_aligned(std::max<size_t>(bytes, 1), align);
+}
+
+inline void deallocate_bytes(void* ptr, size_t bytes, size_t align) {
+    concurrent_free_aligned(ptr, std::max<size_t>(bytes, 1), align);
+}
+
+// 满足 Allocator 要求的分配器，按 alignof(T) 对齐
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+    // 没有状态，容器交换、移动时不需要关心分配器
+    using propagate_on_container_move_assignment = std::true_type;
+    using is_always_equal = std::true_type;
+
+    allocator() noexcept = default;
+    template <class U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return (T*)allocate_bytes(n * sizeof(T), alignof(T));
+    }
+    void deallocate(T* ptr, size_t n) noexcept {
+        deallocate_bytes(ptr, n * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+    return false;
+}
+
+// std::pmr 的内存资源，通过 get_pool_resource() 获取
+class pool_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t align) override {
+        return allocate_bytes(bytes, align);
+    }
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override {
+        deallocate_bytes(ptr, bytes, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        // 内存都来自同一个内存池，任何一个 pool_resource 申请的内存都可以由另一个释放
+        return this == &other || dynamic_cast<const pool_resource*>(&other) != nullptr;
+    }
+};
+
+inline pool_resource* get_pool_resource() {
+    static pool_resource inst;
+    return &inst;
+}
+
+} // namespace cmpool
@@ -0,0 +1,374 @@
+// 多线程性能测试，在几种典型负载下对比 glibc 的 malloc/free 和内存池的 concurrent_allocate/concurrent_free
+//   g++ -std=c++17 -O2 -pthread CentralCache.cpp PageCache.cpp ThreadCache.cpp CpuCache.cpp Scavenger.cpp Stats.cpp HeapProfiler.cpp Numa.cpp Benchmark.cpp -o benchmark
+//   ./benchmark [--threads N] [--ops N] [--workload 名称] [--allocator malloc|pool] [--json]
+// 线程数从 1 开始按 2 倍增长到 N（默认为 CPU 核数），每个组合在单独的子进程中运行，峰值 RSS 互不影响
+// 每行输出一个组合: 吞吐量（ops/s）、单次操作延迟的 p50/p99/p999（纳秒）以及峰值 RSS（KB），默认 CSV，--json 输出 JSON
+// 注意不要和 libcmpool.so 一起使用，否则 malloc 也会走内存池
+
+#include "ConcurrentAllocate.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// 被测的两种分配器，接口保持一致，模板实例化后没有虚函数调用的开销
+struct MallocAllocator {
+    static const char* name() {
+        return "malloc";
+    }
+    static void* allocate(size_t size) {
+        return malloc(size);
+    }
+    static void deallocate(void* ptr, size_t) {
+        free(ptr);
+    }
+    static void* reallocate(void* ptr, size_t, size_t new_size) {
+        return realloc(ptr, new_size);
+    }
+};
+
+struct PoolAllocator {
+    static const char* name() {
+        return "pool";
+    }
+    static void* allocate(size_t size) {
+        return concurrent_allocate(size);
+    }
+    static void deallocate(void* ptr, size_t) {
+        concurrent_free(ptr);
+    }
+    static void* reallocate(void* ptr, size_t, size_t new_size) {
+        return concurrent_reallocate(ptr, new_size);
+    }
+};
+
+// 每个线程记录自己的操作延迟，结束后再合并，计时过程中不共享任何数据
+struct Recorder {
+    vector<unsigned int> latency; // 纳秒
+    size_t ops = 0;
+
+    template <class F>
+    auto timed(F&& f) -> decltype(f()) {
+        auto begin = chrono::steady_clock::now();
+        auto ret = f();
+        auto cost = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+        latency.push_back((unsigned int)min<long long>(cost, UINT32_MAX));
+        ++ops;
+        return ret;
+    }
+};
+
+// 释放操作没有返回值，包一层方便统一计时
+#define TIMED_FREE(rec, expr) rec.timed([&] { expr; return 0; })
+
+struct Options {
+    size_t ops = 200000; // 每个线程的操作次数
+    size_t max_threads = max(1u, thread::hardware_concurrency());
+    string workload;
+    string allocator;
+    bool json = false;
+};
+
+static Options options;
+
+// 固定大小反复申请释放，每次申请 100 个 64 字节的对象再全部释放
+template <class A>
+void fixed_churn(size_t, Recorder& rec) {
+    void* objs[100];
+    for (size_t done = 0; done < options.ops; done += 200) {
+        for (size_t i = 0; i < 100; ++i) {
+            objs[i] = rec.timed([&] { return A::allocate(64); });
+        }
+        for (size_t i = 0; i < 100; ++i) {
+            TIMED_FREE(rec, A::deallocate(objs[i], 64));
+        }
+    }
+}
+
+// 每个线程保留 1000 个槽位，随机挑一个槽位，有对象就释放，没有就在 [lo, hi] 中随机选一个大小申请
+template <class A>
+void random_band(size_t id, Recorder& rec, size_t lo, size_t hi) {
+    const size_t slots = 1000;
+    vector<void*> ptrs(slots, nullptr);
+    vector<size_t> sizes(slots, 0);
+    mt19937_64 rng(id + 1);
+    uniform_int_distribution<size_t> size_dist(lo, hi);
+    for (size_t i = 0; i < options.ops; ++i) {
+        size_t k = rng() % slots;
+        if (ptrs[k] != nullptr) {
+            TIMED_FREE(rec, A::deallocate(ptrs[k], sizes[k]));
+            ptrs[k] = nullptr;
+        } else {
+            sizes[k] = size_dist(rng);
+            ptrs[k] = rec.timed([&] { return A::allocate(sizes[k]); });
+            // 写一下，避免只测到没有访问过的虚拟内存
+            *(char*)ptrs[k] = 1;
+        }
+    }
+    for (size_t k = 0; k < slots; ++k) {
+        if (ptrs[k] != nullptr) {
+            A::deallocate(ptrs[k], sizes[k]);
+        }
+    }
+}
+
+template <class A>
+void random_small(size_t id, Recorder& rec) {
+    random_band<A>(id, rec, 8, 128);
+}
+
+template <class A>
+void random_medium(size_t id, Recorder& rec) {
+    random_band<A>(id, rec, 129, 8 * 1024);
+}
+
+template <class A>
+void random_large(size_t id, Recorder& rec) {
+    random_band<A>(id, rec, 8 * 1024 + 1, MAX_BYTES);
+}
+
+// 生产者和消费者两两配对，生产者申请后通过单生产者单消费者的环形队列交给消费者释放
+struct Channel {
+    static const size_t N = 1024;
+    atomic<void*> slots[N] = {};
+};
+
+static vector<Channel>* channels;
+
+template <class A>
+void producer_consumer(size_t id, Recorder& rec) {
+    Channel& ch = (*channels)[id / 2];
+    // 线程数为奇数时最后一个线程没有伙伴，自己申请自己释放
+    bool alone = (id % 2 == 0) && (id + 1 == options.max_threads);
+    size_t ops = options.ops / 2;
+    for (size_t i = 0; i < ops; ++i) {
+        atomic<void*>& slot = ch.slots[i % Channel::N];
+        if (alone) {
+            void* p = rec.timed([&] { return A::allocate(256); });
+            TIMED_FREE(rec, A::deallocate(p, 256));
+        } else if (id % 2 == 0) {
+            void* p = rec.timed([&] { return A::allocate(256); });
+            while (slot.load(memory_order_acquire) != nullptr) {
+                this_thread::yield();
+            }
+            slot.store(p, memory_order_release);
+        } else {
+            void* p;
+            while ((p = slot.load(memory_order_acquire)) == nullptr) {
+                this_thread::yield();
+            }
+            slot.store(nullptr, memory_order_relaxed);
+            TIMED_FREE(rec, A::deallocate(p, 256));
+        }
+    }
+}
+
+// larson: 每个线程持有一组长期存活的对象，随机替换其中一部分
+// 每一轮结束后对象交给下一轮的另一个线程，释放的对象大多是别的线程申请的
+static const size_t LARSON_ROUNDS = 8;
+static vector<vector<pair<void*, size_t>>>* larson_sets;
+static size_t larson_round;
+
+template <class A>
+void larson(size_t id, Recorder& rec) {
+    auto& objs = (*larson_sets)[(id + larson_round) % larson_sets->size()];
+    mt19937_64 rng(id * 131 + larson_round);
+    uniform_int_distribution<size_t> size_dist(16, 1024);
+    if (objs.empty()) {
+        objs.resize(1000);
+        for (auto& o : objs) {
+            o.second = size_dist(rng);
+            o.first = rec.timed([&] { return A::allocate(o.second); });
+        }
+    }
+    size_t ops = options.ops / LARSON_ROUNDS / 2;
+    for (size_t i = 0; i < ops; ++i) {
+        auto& o = objs[rng() % objs.size()];
+        TIMED_FREE(rec, A::deallocate(o.first, o.second));
+        o.second = size_dist(rng);
+        o.first = rec.timed([&] { return A::allocate(o.second); });
+    }
+}
+
+// realloc 增长: 从 16 字节开始每次扩大 1.5 倍直到 1MB
+template <class A>
+void realloc_growth(size_t, Recorder& rec) {
+    size_t done = 0;
+    while (done < options.ops) {
+        size_t size = 16;
+        void* p = rec.timed([&] { return A::allocate(size); });
+        while (size < 1024 * 1024) {
+            size_t new_size = size + size / 2;
+            p = rec.timed([&] { return A::reallocate(p, size, new_size); });
+            ((char*)p)[new_size - 1] = 1;
+            size = new_size;
+        }
+        TIMED_FREE(rec, A::deallocate(p, size));
+        done = rec.ops;
+    }
+}
+
+struct Result {
+    size_t ops = 0;
+    double seconds = 0;
+    unsigned int p50 = 0, p99 = 0, p999 = 0;
+    long peak_rss_kb = 0;
+};
+
+template <class A>
+Result run(const string& workload, size_t nthreads) {
+    function<void(size_t, Recorder&)> body;
+    if (workload == "fixed") {
+        body = fixed_churn<A>;
+    } else if (workload == "random-small") {
+        body = random_small<A>;
+    } else if (workload == "random-medium") {
+        body = random_medium<A>;
+    } else if (workload == "random-large") {
+        body = random_large<A>;
+    } else if (workload == "producer-consumer") {
+        body = producer_consumer<A>;
+    } else if (workload == "larson") {
+        body = larson<A>;
+    } else {
+        body = realloc_growth<A>;
+    }
+    options.max_threads = nthreads;
+    vector<Channel> chs(nthreads / 2 + 1);
+    channels = &chs;
+    vector<vector<pair<void*, size_t>>> sets(nthreads);
+    larson_sets = &sets;
+
+    vector<Recorder> recs(nthreads);
+    for (auto& r : recs) {
+        r.latency.reserve(options.ops + options.ops / 2);
+    }
+    // larson 每一轮都创建新线程，其余负载只跑一轮
+    size_t rounds = workload == "larson" ? LARSON_ROUNDS : 1;
+    auto begin = chrono::steady_clock::now();
+    for (larson_round = 0; larson_round < rounds; ++larson_round) {
+        vector<thread> ths;
+        for (size_t i = 0; i < nthreads; ++i) {
+            ths.emplace_back(body, i, ref(recs[i]));
+        }
+        for (auto& t : ths) {
+            t.join();
+        }
+    }
+    Result res;
+    res.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    for (auto& set : sets) {
+        for (auto& o : set) {
+            A::deallocate(o.first, o.second);
+        }
+    }
+
+    vector<unsigned int> all;
+    for (auto& r : recs) {
+        res.ops += r.ops;
+        all.insert(all.end(), r.latency.begin(), r.latency.end());
+    }
+    if (!all.empty()) {
+        auto pct = [&](double p) {
+            size_t k = min(all.size() - 1, (size_t)(p * all.size()));
+            nth_element(all.begin(), all.begin() + k, all.end());
+            return all[k];
+        };
+        res.p50 = pct(0.5);
+        res.p99 = pct(0.99);
+        res.p999 = pct(0.999);
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    res.peak_rss_kb = usage.ru_maxrss;
+    return res;
+}
+
+static void print(const char* allocator, const string& workload, size_t nthreads, const Result& r, bool first) {
+    double ops_per_sec = r.seconds > 0 ? r.ops / r.seconds : 0;
+    if (options.json) {
+        printf("%s{\"allocator\":\"%s\",\"workload\":\"%s\",\"threads\":%zu,\"ops\":%zu,\"seconds\":%.6f,"
+               "\"ops_per_sec\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"peak_rss_kb\":%ld}",
+               first ? "" : ",\n", allocator, workload.c_str(), nthreads, r.ops, r.seconds,
+               ops_per_sec, r.p50, r.p99, r.p999, r.peak_rss_kb);
+    } else {
+        printf("%s,%s,%zu,%zu,%.6f,%.0f,%u,%u,%u,%ld\n", allocator, workload.c_str(), nthreads, r.ops, r.seconds,
+               ops_per_sec, r.p50, r.p99, r.p999, r.peak_rss_kb);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            options.max_threads = max(1, atoi(argv[++i]));
+        } else if (arg == "--ops" && i + 1 < argc) {
+            options.ops = max(1000, atoi(argv[++i]));
+        } else if (arg == "--workload" && i + 1 < argc) {
+            options.workload = argv[++i];
+        } else if (arg == "--allocator" && i + 1 < argc) {
+            options.allocator = argv[++i];
+        } else if (arg == "--json") {
+            options.json = true;
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--ops N] [--workload name] [--allocator malloc|pool] [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+    const vector<string> workloads = { "fixed", "random-small", "random-medium", "random-large",
+                                       "producer-consumer", "larson", "realloc" };
+    vector<size_t> thread_counts;
+    for (size_t n = 1; n < options.max_threads; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(options.max_threads);
+
+    if (options.json) {
+        printf("[\n");
+    } else {
+        printf("allocator,workload,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb\n");
+    }
+    fflush(stdout);
+    bool first = true;
+    for (const string& workload : workloads) {
+        if (!options.workload.empty() && options.workload != workload) {
+            continue;
+        }
+        for (size_t nthreads : thread_counts) {
+            for (int which = 0; which < 2; ++which) {
+                const char* name = which == 0 ? MallocAllocator::name() : PoolAllocator::name();
+                if (!options.allocator.empty() && options.allocator != name) {
+                    continue;
+                }
+                // 子进程中运行，ru_maxrss 只反映这一个组合
+                pid_t pid = fork();
+                if (pid == 0) {
+                    Result r = which == 0 ? run<MallocAllocator>(workload, nthreads) : run<PoolAllocator>(workload, nthreads);
+                    print(name, workload, nthreads, r, first);
+                    _exit(0);
+                }
+                int status;
+                waitpid(pid, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    fprintf(stderr, "%s %s threads=%zu failed\n", name, workload.c_str(), nthreads);
+                    return 1;
+                }
+                first = false;
+            }
+        }
+    }
+    if (options.json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
@@ -1,101 +1,203 @@
 #include "CentralCache.h"
 #include "PageCache.h"
+#include "Stats.h"
 
-CentralCache CentralCache::inst_;
+CentralCacheNodes CentralCache::inst_;
 
-size_t CentralCache::fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size) {
+// 把 obj 接到 [start, end] 这段链表的末尾
+static inline void append_obj(void*& start, void*& end, void* obj) {
+    if (start == nullptr) {
+        start = obj;
+    } else {
+        next_obj(end) = obj;
+    }
+    end = obj;
+}
+
+size_t CentralCache::fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size, void* owner) {
     size_t index = SizeClass::index(size);
+    // 先看 TransferCache 中有没有别的线程整批还回来的对象
+    size_t n = transfer_cache_.pop(index, start, end);
+    if (n > 0) {
+        if (n > batch_num) {
+            // 多出来的部分仍然是完整的一批，放回去给下一个线程
+            void* last = start;
+            for (size_t i = 1; i < batch_num; ++i) {
+                last = next_obj(last);
+            }
+            void* rest = next_obj(last);
+            next_obj(last) = nullptr;
+            release_range_obj(rest, end, n - batch_num, size);
+            end = last;
+            n = batch_num;
+        }
+        return n;
+    }
     span_list_[index].mtx_.lock(); // 桶锁
     // 在对应哈希桶中获取一个非空的 Span
     Span* span = get_one_span(span_list_[index], size);
-    // 获得的页和页中的自由链表不能为空
-    assert(span && span->free_list_);
+    // 获得的 Span 中一定还有空闲的对象
+    assert(span && span->use_count_ < span->capacity_);
     // 从 Span 中获取 batch_num 个对象，如果不够 batch_num 个，有多少拿多少
-    start = span->free_list_;
-    end = start;
-    size_t actual_num = 1;
-    while (--batch_num && next_obj(end) != nullptr) {
-        end = next_obj(end);
+    // 先用还回来过的对象（可能还在 CPU 缓存里），再按顺序切新的
+    char* base = (char*)(span->page_id_ << PAGE_SHIFT);
+    size_t actual_num = 0;
+    start = nullptr;
+    end = nullptr;
+    // 切出去过、又还回来的对象个数，为 0 时（比如刚申请的 Span）不需要扫描位图
+    size_t recycled = span->carved_ - span->use_count_;
+    size_t want = std::min(batch_num, recycled);
+    for (size_t w = 0; w < SPAN_BITMAP_WORDS && actual_num < want; ++w) {
+        unsigned long long& word = span->free_bitmap_[w];
+        while (word != 0 && actual_num < want) {
+            size_t i = w * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            append_obj(start, end, base + i * size);
+            ++actual_num;
+        }
+    }
+    while (actual_num < batch_num && span->carved_ < span->capacity_) {
+        append_obj(start, end, base + (size_t)span->carved_ * size);
+        ++span->carved_;
         ++actual_num;
     }
-    span->free_list_ = next_obj(end); // 取完后剩下的对象继续放到自由链表
     next_obj(end) = nullptr; // 取出的一段链表的表尾置空
     span->use_count_ += actual_num; // 更新被分配给 ThreadCache 的计数
+    // 对象被取光了，移到 full_list_，下次找 Span 时不会再看到它
+    if (span->use_count_ == span->capacity_) {
+        span_list_[index].erase(span);
+        full_list_[index].push_front(span);
+    }
+    // 别的线程释放时会读这个字段，不加锁
+    __atomic_store_n(&span->owner_, owner, __ATOMIC_RELAXED);
     span_list_[index].mtx_.unlock(); // 解锁
     return actual_num;
 }
 
-// 获取一个非空的 Span
+// 获取一个有空闲对象的 Span
 Span* CentralCache::get_one_span(SpanList& list, size_t size) {
-    // 查看当前的 SpanList 中是否有还有未分配对象的 Span
-    Span* it = list.begin();
-    while (it != list.end()) {
-        if (it->free_list_) {
-            return it;
-        } else {
-            it = it->next_;
-        }
+    // span_list_ 中的 Span 都还有空闲对象，取第一个即可
+    if (!list.empty()) {
+        return list.begin();
     }
     // 在 fetch_range_obj() 里上的锁，先把 CentralCache 的桶锁解掉，这样如果其他线程释放内存对象回来，不会阻塞
     list.mtx_.unlock();
     // 走到这里说明没有空闲 Span 了，只能找 PageCache 要
-    PageCache::get_instance()->page_mtx_.lock(); // 这里加锁也可以，如果在 new_span 函数里加锁，需要使用递归锁
-    Span* span = PageCache::get_instance()->new_span(SizeClass::num_move_page(size));
+    // PageCache 在内部给对应的分片加锁
+    Span* span = PageCache::get_instance()->new_span(SizeClass::num_move_page(size), node());
     span->object_size_ = size;
-    PageCache::get_instance()->page_mtx_.unlock();
-    // 对获取 Span 进行切分，不需要加锁，其他线程访问不到这个 Span
-    // 计算 Span 的大块内存的起始地址和大块内存的大小
-    // page_id_ 记录起始页的页号，起始地址=页号*每页的大小
-    char* start = (char*)(span->page_id_ << PAGE_SHIFT);
-    // n_ 记录页的数量，终止地址=页数*每页的大小+起始地址
-    size_t bytes = (span->n_ << PAGE_SHIFT);
-    char* end = start + bytes;
-
-    // 把大块内存切成小块链接起来
-    // 先切一块下来去做头，方便尾插
-    span->free_list_ = start;
-    start += size;
-    void* tail = span->free_list_;
-    // 尾插
-    while (start < end) {
-        next_obj(tail) = start;
-        tail = start;
-        start += size;
-    }
-    next_obj(tail) = nullptr;
-    // 切好 Span 以后，需要把 Span 挂到桶里面去的时候，再加锁
+    span->is_direct_ = false;
+    span->node_ = node();
+    // 初始化 Span 的位图，不需要加锁，其他线程访问不到这个 Span
+    // 对象在被取走的时候才按顺序切出来，这里不需要访问 Span 的内存
+    span->capacity_ = (span->n_ << PAGE_SHIFT) / size;
+    span->carved_ = 0;
+    span->reciprocal_ = (((unsigned long long)1 << 32) + size - 1) / size;
+    memset(span->free_bitmap_, 0, sizeof(span->free_bitmap_));
+    span->use_count_ = 0;
+    // 初始化好 Span 以后，需要把 Span 挂到桶里面去的时候，再加锁
+    // 解锁期间别的线程可能放进来了其他 Span，新的 Span 一个对象都没有用，放在最后
     list.mtx_.lock();
-    list.push_front(span);
+    list.push_back(span);
     return span;
 }
 
+void CentralCache::release_range_obj(void* start, void* end, size_t n, size_t size) {
+    assert(start && end && n > 0);
+    // 一批对象通常来自同一个节点，按第一个对象判断，放回它所在节点的 TransferCache
+    CentralCache* home = this;
+    if (NumaTopology::get_instance()->nodes() > 1) {
+        home = get_instance(PageCache::get_instance()->map_obj_to_span(start)->node_);
+    }
+    if (!home->transfer_cache_.push(SizeClass::index(size), start, end, n)) {
+        home->release_list_to_spans(start, size);
+    }
+}
+
 // 将一定数量的对象释放到 Span
 void CentralCache::release_list_to_spans(void* start, size_t size) {
     assert(start);
     size_t index = SizeClass::index(size);
+    void* remote[NUMA_MAX_NODES] = {}; // 属于其他节点的对象，解锁以后再还
     span_list_[index].mtx_.lock();
     while (start) {
         void* next = next_obj(start);
         // 通过映射找到对应的 Span
         Span* span = PageCache::get_instance()->map_obj_to_span(start);
-        // 将 start 小块内存头插到 Span 结构的自由链表中
-        next_obj(start) = span->free_list_;
-        span->free_list_ = start;
+        if (span->node_ != node()) {
+            next_obj(start) = remote[span->node_];
+            remote[span->node_] = start;
+            start = next;
+            continue;
+        }
+        // 对象相对 Span 起始地址的偏移一定是对象大小的整数倍，乘以倒数再右移 32 位就是准确的序号
+        size_t offset = (char*)start - (char*)(span->page_id_ << PAGE_SHIFT);
+        size_t i = (offset * span->reciprocal_) >> 32;
+        assert(i * span->object_size_ == offset && i < span->carved_);
+        assert((span->free_bitmap_[i / 64] & (1ull << (i % 64))) == 0); // 重复释放
+        span->free_bitmap_[i / 64] |= 1ull << (i % 64);
+        // 原来已经被取光的 Span 有了空闲对象，移回 span_list_ 的前面，它是最满的
+        if (span->use_count_ == span->capacity_) {
+            full_list_[index].erase(span);
+            span_list_[index].push_front(span);
+        }
         --span->use_count_; // 更新分配给 ThreadCache 的计数
         if (span->use_count_ == 0) {
             span_list_[index].erase(span);
-            span->free_list_ = nullptr;
             span->next_ = nullptr;
             span->prev_ = nullptr;
 
             // 释放 Span 给 PageCache 时，使用 PageCache 的锁就可以了
             span_list_[index].mtx_.unlock();
-            PageCache::get_instance()->page_mtx_.lock();
             PageCache::get_instance()->releas_span_to_page(span);
-            PageCache::get_instance()->page_mtx_.unlock();
             span_list_[index].mtx_.lock();
         }
         start = next;
     }
     span_list_[index].mtx_.unlock();
-}
\ No newline at end of file
+    for (size_t i = 0; i < NUMA_MAX_NODES; ++i) {
+        if (remote[i] != nullptr) {
+            get_instance(i)->release_list_to_spans(remote[i], size);
+        }
+    }
+}
+
+void CentralCache::drain_transfer_cache() {
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        void* start = nullptr;
+        void* end = nullptr;
+        while (transfer_cache_.pop(i, start, end) > 0) {
+            release_list_to_spans(start, SizeClass::bytes(i));
+        }
+    }
+}
+
+void CentralCache::collect_stats(PoolStats& stats) {
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        SizeClassStats& cls = stats.classes[i];
+        size_t size = SizeClass::bytes(i);
+        std::lock_guard<std::mutex> lock(span_list_[i].mtx_);
+        for (SpanList* list : { &span_list_[i], &full_list_[i] }) {
+            for (Span* it = list->begin(); it != list->end(); it = it->next_) {
+                size_t bytes = it->n_ << PAGE_SHIFT;
+                ++cls.span_count;
+                cls.span_bytes += bytes;
+                // Span 能切出来的对象个数减去分出去的个数，就是还留在 Span 中的个数
+                cls.central_free_objects += bytes / size - it->use_count_;
+            }
+        }
+        cls.transfer_cache_objects += transfer_cache_.objects(i);
+    }
+}
+
+void CentralCache::lock_all() {
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        span_list_[i].mtx_.lock();
+    }
+}
+
+void CentralCache::unlock_all() {
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        span_list_[i].mtx_.unlock();
+    }
+}
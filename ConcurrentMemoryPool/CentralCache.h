@@ -1,23 +1,65 @@
 #pragma once
 
 #include "Common.h"
+#include "TransferCache.h"
+#include "Numa.h"
 
-// 由于全局只能有一个 CentralCache 对象，所以这里设计为单例模式
+struct PoolStats;
+struct CentralCacheNodes;
+
+// 每个 NUMA 节点一个 CentralCache 对象，按节点编号取
 class CentralCache {
 public:
-    static CentralCache* get_instance() {
-        return &inst_;
-    }
-    // 获取一个非空的 Span
+    // 当前线程所在节点的 CentralCache
+    static CentralCache* get_instance();
+    static CentralCache* get_instance(size_t node);
+    // 获取一个有空闲对象的 Span
     Span* get_one_span(SpanList& list, size_t size);
-    // 从 CentralCache 获取一定数量的对象给 ThreadCache
-    size_t fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size);
-    // 将一定数量的对象释放到 Span
+    // 从 CentralCache 获取一定数量的对象给 ThreadCache，owner 记录到对象所在的 Span 上
+    size_t fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size, void* owner = nullptr);
+    // 将一批对象还给 CentralCache，优先整批放进 TransferCache，放不下再释放到 Span
+    // 按第一个对象所在的节点放，不一定是调用它的这个对象
+    void release_range_obj(void* start, void* end, size_t n, size_t size);
+    // 将一定数量的对象释放到 Span，属于其他节点的对象转交给对应节点的 CentralCache
     void release_list_to_spans(void* start, size_t size);
+    // 把 TransferCache 中缓存的对象全部还给 Span，这样空闲的 Span 才能回到 PageCache
+    void drain_transfer_cache();
+    // 统计每个桶的 Span 和对象个数
+    void collect_stats(PoolStats& stats);
+    // 对所有桶加锁和解锁，fork 时使用
+    void lock_all();
+    void unlock_all();
 private:
     CentralCache() = default;
     CentralCache(const CentralCache&) = delete;
     CentralCache& operator=(const CentralCache&) = delete;
-    static CentralCache inst_; // 仅声明，定义在 .cpp 里面
+    friend struct CentralCacheNodes;
+    // 这个对象对应的节点
+    size_t node() const;
+    static CentralCacheNodes inst_; // 仅声明，定义在 .cpp 里面
+    // 每个桶的 Span 分成两个链表，都由 span_list_[i].mtx_ 保护:
+    // span_list_ 中的 Span 还有空闲对象，取对象时直接用第一个；对象被取光的 Span 移到 full_list_，释放回一个对象时再移回来
+    // span_list_ 大致按占用程度排列: 从 full_list_ 移回来的放在前面，新申请的放在后面，
+    // 优先从快满的 Span 中取对象，占用少的 Span 更容易被全部还回来，交还给 PageCache
     SpanList span_list_[NFREELISTS];
-};
\ No newline at end of file
+    SpanList full_list_[NFREELISTS];
+    TransferCache transfer_cache_;
+};
+
+// 全局对象直接定义成数组时，GCC 不会在编译期初始化，而是生成全局构造函数，在这之前的 malloc 会用到未初始化的锁和链表
+// 作为成员数组放在结构体里面就可以在编译期完成初始化
+struct CentralCacheNodes {
+    CentralCache caches_[NUMA_MAX_NODES];
+};
+
+inline CentralCache* CentralCache::get_instance() {
+    return &inst_.caches_[NumaTopology::get_instance()->current_node()];
+}
+
+inline CentralCache* CentralCache::get_instance(size_t node) {
+    return &inst_.caches_[node];
+}
+
+inline size_t CentralCache::node() const {
+    return this - inst_.caches_;
+}
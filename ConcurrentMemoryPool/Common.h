@@ -3,6 +3,7 @@
 #include <iostream>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 #include <thread>
 #include <mutex>
 #include <sys/mman.h>
@@ -13,6 +14,8 @@
 static const size_t MAX_BYTES = 256 * 1024;
 // 一个 ThreadCache 中自由链表的个数
 static const size_t NFREELISTS = 208;
+// ThreadCache 中一个自由链表最长可以缓存的对象个数
+static const size_t MAX_FREE_LIST_LENGTH = 8192;
 // PageCache 中的页数范围从 1~128，0 下标处不挂东西
 static const size_t NPAGES = 129;
 // 页大小转换偏移量，Linux 下一页为 2^12bytes=4KB
@@ -48,6 +51,18 @@ inline static void system_free(void* ptr, size_t object_size) {
     munmap(ptr, object_size);
 }
 
+// 把物理内存还给操作系统，但保留虚拟地址，再次访问时内核会重新分配（清零的）物理页
+// 定义 CMPOOL_MADV_FREE 时使用 MADV_FREE，内核只在内存紧张时才真正回收，开销更小，但 RSS 不会立刻下降
+// HugeTLB 大页上不按大页对齐的范围不能释放，这时返回 false
+inline static bool system_release(void* ptr, size_t bytes) {
+#ifdef CMPOOL_MADV_FREE
+    if (madvise(ptr, bytes, MADV_FREE) == 0) {
+        return true;
+    }
+#endif
+    return madvise(ptr, bytes, MADV_DONTNEED) == 0;
+}
+
 // 返回 obj 对象当中用于存储下一个对象的地址的引用
 static inline void*& next_obj(void* obj) {
     return *(void**)obj;
@@ -59,6 +74,10 @@ public:
     // 将释放的对象头插到自由链表
     void push(void* obj) {
         assert(obj);
+        // 第一个放进空链表的对象就是表尾
+        if (free_list_ == nullptr) {
+            tail_ = obj;
+        }
         // 头插
         next_obj(obj) = free_list_;
         free_list_ = obj;
@@ -71,10 +90,16 @@ public:
         void* obj = free_list_;
         free_list_ = next_obj(obj);
         --size_;
+        if (size_ < low_water_) {
+            low_water_ = size_;
+        }
         return obj;
     }
     // 将释放的 n 个内存块头插入自由链表
     void push_range(void* start, void* end, size_t n) {
+        if (free_list_ == nullptr) {
+            tail_ = end;
+        }
         next_obj(end) = free_list_;
         free_list_ = start;
         size_ += n;
@@ -82,10 +107,57 @@ public:
     // 将自由链表清空
     void* clear() {
         size_ = 0;
+        low_water_ = 0;
         void* list = free_list_;
         free_list_ = nullptr;
         return list;
     }
+    // 从第二个对象开始取下 n 个对象，[start, end] 串成链表，表尾置空，只需要走 n 步
+    // 链表头是刚释放的对象，留下来给接下来的申请用；n 等于链表长度时整条取下
+    void pop_range(size_t n, void*& start, void*& end) {
+        assert(n > 0 && n <= size_);
+        if (n == size_) {
+            end = tail_;
+            start = clear();
+            return;
+        }
+        start = next_obj(free_list_);
+        end = start;
+        for (size_t i = 1; i < n; ++i) {
+            end = next_obj(end);
+        }
+        next_obj(free_list_) = next_obj(end);
+        if (end == tail_) {
+            tail_ = free_list_;
+        }
+        next_obj(end) = nullptr;
+        size_ -= n;
+        low_water_ = std::min(low_water_, size_);
+    }
+    // 从自由链表尾部取下 n 个对象，[start, end] 串成链表，表尾置空
+    // 尾部的对象是最早放进来的，头部最近用过的对象留在链表里；需要从头走 size - n 步，只在回收时使用
+    void pop_back_range(size_t n, void*& start, void*& end) {
+        assert(n > 0 && n <= size_);
+        end = tail_;
+        if (n == size_) {
+            start = clear();
+            return;
+        }
+        void* last = free_list_;
+        for (size_t i = 1; i < size_ - n; ++i) {
+            last = next_obj(last);
+        }
+        start = next_obj(last);
+        next_obj(last) = nullptr;
+        tail_ = last;
+        size_ -= n;
+        low_water_ = std::min(low_water_, size_);
+    }
+    // 自由链表的最后一个对象，链表不为空时才有意义
+    void* back() {
+        assert(free_list_);
+        return tail_;
+    }
     // 判断自由链表是否为空
     bool empty() {
         return free_list_ == nullptr;
@@ -98,15 +170,28 @@ public:
     size_t size() {
         return size_;
     }
+    // 上次 reset_low_water 以来链表最短时的长度，这么多个对象在这段时间里一直没有被用到
+    size_t low_water() {
+        return low_water_;
+    }
+    void reset_low_water() {
+        low_water_ = size_;
+    }
+    // 链表连续超过上限的次数，用来缩小 max_size
+    size_t& overages() {
+        return overages_;
+    }
 private:
     void* free_list_ = nullptr; // 指向自由链表的指针
+    void* tail_ = nullptr; // 自由链表的最后一个对象，整批还给 CentralCache 时不需要再遍历一遍
     size_t max_size_ = 1; // 一次申请内存块的数量
     size_t size_ = 0; // 记录自由链表中内存块数量
+    size_t low_water_ = 0; // 自由链表的低水位
+    size_t overages_ = 0; // 链表连续超过上限的次数
 };
 
-// 管理空间范围划分与对齐、映射关系的类
-
-class SizeClass {
+// 空间范围划分与对齐的规则，只在编译期用来生成 SizeClassTable，运行时走查表
+class SizeClassRule {
     // [1,128]              8byte对齐       freelist[0,16)
     // [128+1,1024]         16byte对齐      freelist[16,72)
     // [1024+1,8*1024]      128byte对齐     freelist[72,128)
@@ -114,37 +199,20 @@ class SizeClass {
     // [64*1024+1,256*1024] 8*1024byte对齐  freelist[184,208)
 public:
     // align_num 是对齐数
-    static inline size_t round_up_(size_t bytes, size_t align_num) {
+    static constexpr size_t round_up_(size_t bytes, size_t align_num) {
         return (((bytes) + align_num-1) & ~(align_num - 1));
     }
-    // 获取向上对齐后的字节数
-    static inline size_t round_up(size_t bytes) {
-        assert(bytes <= MAX_BYTES);
-        if (bytes <= 128) {
-            return round_up_(bytes, 8);
-        } else if (bytes <= 8 * 128) {
-            return round_up_(bytes, 16);
-        } else if (bytes <= 8 * 1024) {
-            return round_up_(bytes, 128);
-        } else if (bytes <= 64 * 1024) {
-            return round_up_(bytes, 1024);
-        } else if (bytes <= 256 * 1024) {
-            return round_up_(bytes, 8 * 1024);
-        } else {
-            assert(false);
-            return -1;
-        }
-    }
     // bytes 是字节数，align_shift是 该字节数所遵守的对齐数，以位运算中需要左移的位数表示
-    static inline size_t index_(size_t bytes, size_t align_shift) {
-        return ((bytes + (1 << align_shift) - 1) >> align_shift) - 1;
+    static constexpr size_t index_(size_t bytes, size_t align_shift) {
+        return ((bytes + ((size_t)1 << align_shift) - 1) >> align_shift) - 1;
     }
-    // 计算映射的哪一个自由链表桶
-    static inline size_t index(size_t bytes) {
-        assert(bytes <= MAX_BYTES);
+    // 计算映射的哪一个自由链表桶，0 字节按 8 字节处理
+    static constexpr size_t index(size_t bytes) {
         // 每个区间有多少个链
-        static int group_array[4] = { 16, 56, 56, 56 };
-        if (bytes <= 128) {
+        const size_t group_array[4] = { 16, 56, 56, 56 };
+        if (bytes == 0) {
+            return 0;
+        } else if (bytes <= 128) {
             return index_(bytes, 3); // 3 是 2^3，这里传的是使用位运算要达到对齐数需要左移的位数
         } else if (bytes <= 1024) {
             return index_(bytes - 128, 4) + group_array[0];
@@ -152,17 +220,14 @@ public:
             return index_(bytes - 1024, 7) + group_array[0] + group_array[1];
         } else if (bytes <= 64 * 1024) {
             return index_(bytes - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
-        } else if (bytes <= 256 * 1024) {
-            return index_(bytes - 64 * 1024, 13) + group_array[0] + group_array[1] + group_array[2] + group_array[3];
         } else {
-            assert(false);
-            return -1;
+            return index_(bytes - 64 * 1024, 13) + group_array[0] + group_array[1] + group_array[2] + group_array[3];
         }
     }
     // 根据传入的桶的下标，计算出该桶所管理的自由链表中的对象大小
-    static inline size_t bytes(size_t index) {
-        static size_t group[4] = { 16, 56, 56, 56 };
-        static size_t total_group[4] = { 16, 72, 128, 184 };
+    static constexpr size_t bytes(size_t index) {
+        const size_t group[4] = { 16, 56, 56, 56 };
+        const size_t total_group[4] = { 16, 72, 128, 184 };
         if (index < total_group[0]) {
             return (index + 1) * 8;
         } else if (index < total_group[1]) {
@@ -175,13 +240,16 @@ public:
             return group[0] * 8 + group[1] * 16 + group[2] * 128 + group[3] * 1024 + (index + 1 - total_group[3]) * 8 * 1024;
         }
     }
+    // 字节数在 SizeClassTable::class_array 中的下标
+    static constexpr size_t array_index(size_t bytes) {
+        return bytes <= 1024 ? (bytes + 7) >> 3 : (bytes + 127 + (120 << 7)) >> 7;
+    }
     // 一次 ThreadCache 应该向 CentralCache 申请的对象的个数
-    static inline size_t num_move_size(size_t size) {
-        assert(size > 0);
+    static constexpr size_t num_move_size(size_t size) {
         // [2, 512]，一次批量移动多少个对象的（慢启动）上限值
         // 小对象一次批量上限高
         // 大对象一次批量上限低
-        int num = MAX_BYTES / size;
+        size_t num = MAX_BYTES / size;
         if (num < 2) {
             num = 2;
         }
@@ -190,6 +258,85 @@ public:
         }
         return num;
     }
+};
+
+// 编译期生成的映射表，参考 tcmalloc 的 class_array
+// 1024 字节以内按 8 字节一格，1024 字节以上按 128 字节一格，每一格对应一个桶下标
+// 因为每一段的对齐数都是格子宽度的整数倍，所以同一格内的字节数一定映射到同一个桶
+struct SizeClassTable {
+    static constexpr size_t array_index(size_t bytes) {
+        return SizeClassRule::array_index(bytes);
+    }
+    static constexpr size_t CLASS_ARRAY_SIZE = SizeClassRule::array_index(MAX_BYTES) + 1;
+
+    constexpr SizeClassTable() : class_array(), class_to_size(), class_to_move() {
+        for (size_t i = 0; i < NFREELISTS; ++i) {
+            class_to_size[i] = SizeClassRule::bytes(i);
+            class_to_move[i] = SizeClassRule::num_move_size(SizeClassRule::bytes(i));
+        }
+        // 每一格取能映射到这一格的最大字节数来计算桶下标
+        for (size_t bytes = 0; bytes <= MAX_BYTES; bytes += (bytes < 1024 ? 8 : 128)) {
+            class_array[array_index(bytes)] = SizeClassRule::index(bytes);
+        }
+    }
+    // 校验查表结果和原来的分段规则完全一致
+    constexpr bool verify() const {
+        for (size_t i = 0; i < NFREELISTS; ++i) {
+            if (class_to_size[i] != SizeClassRule::bytes(i) || SizeClassRule::index(class_to_size[i]) != i) {
+                return false;
+            }
+        }
+        // 每一格中最小和最大的字节数都要映射到表中记录的桶，规则是单调的，所以格子内部的字节数也一致
+        size_t lo = 0;
+        for (size_t bytes = 0; bytes <= MAX_BYTES; bytes += (bytes < 1024 ? 8 : 128)) {
+            size_t cls = class_array[array_index(bytes)];
+            if (array_index(lo) != array_index(bytes) || SizeClassRule::index(lo) != cls
+                || SizeClassRule::index(bytes) != cls || class_to_size[cls] < bytes) {
+                return false;
+            }
+            lo = bytes + 1;
+        }
+        return true;
+    }
+
+    unsigned char class_array[CLASS_ARRAY_SIZE]; // 字节数 -> 桶下标
+    unsigned int class_to_size[NFREELISTS]; // 桶下标 -> 对齐后的字节数
+    unsigned short class_to_move[NFREELISTS]; // 桶下标 -> 一次批量移动的对象个数上限
+};
+
+static_assert(NFREELISTS <= 256, "class_array 中的桶下标用 1 字节存储");
+static_assert(SizeClassRule::index(MAX_BYTES) == NFREELISTS - 1, "最后一个桶必须对应 MAX_BYTES");
+static_assert(SizeClassTable().verify(), "size class 映射表与 SizeClassRule 不一致");
+
+// 管理空间范围划分与对齐、映射关系的类，映射关系都通过查表得到
+class SizeClass {
+public:
+    // 映射表中的下标
+    static inline size_t array_index(size_t bytes) {
+        assert(bytes <= MAX_BYTES);
+        return SizeClassTable::array_index(bytes);
+    }
+    // 获取向上对齐后的字节数，大于 MAX_BYTES 的按页对齐
+    static inline size_t round_up(size_t bytes) {
+        if (bytes > MAX_BYTES) {
+            return SizeClassRule::round_up_(bytes, (size_t)1 << PAGE_SHIFT);
+        }
+        return table_.class_to_size[table_.class_array[array_index(bytes)]];
+    }
+    // 计算映射的哪一个自由链表桶
+    static inline size_t index(size_t bytes) {
+        return table_.class_array[array_index(bytes)];
+    }
+    // 根据传入的桶的下标，计算出该桶所管理的自由链表中的对象大小
+    static inline size_t bytes(size_t index) {
+        assert(index < NFREELISTS);
+        return table_.class_to_size[index];
+    }
+    // 一次 ThreadCache 应该向 CentralCache 申请的对象的个数
+    static inline size_t num_move_size(size_t size) {
+        assert(size > 0);
+        return table_.class_to_move[index(size)];
+    }
     // 计算一次向系统获取几个页
     static inline size_t num_move_page(size_t size) {
         size_t num = num_move_size(size);
@@ -199,34 +346,69 @@ public:
         }
         return npage;
     }
+private:
+    static constexpr SizeClassTable table_{};
 };
 
+// CentralCache 的一个 Span 最多能切出多少个对象，决定了 Span 中位图的大小
+// 一个 Span 的页数由 num_move_page 决定，切出的对象个数不会超过一次批量移动的上限 512
+static const size_t SPAN_MAX_OBJECTS = 512;
+static const size_t SPAN_BITMAP_WORDS = SPAN_MAX_OBJECTS / 64;
+
+constexpr bool span_objects_fit_bitmap() {
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        size_t size = SizeClassRule::bytes(i);
+        size_t npage = SizeClassRule::num_move_size(size) * size >> PAGE_SHIFT;
+        if (npage == 0) {
+            npage = 1;
+        }
+        if ((npage << PAGE_SHIFT) / size > SPAN_MAX_OBJECTS) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(span_objects_fit_bitmap(), "Span 的位图放不下所有对象");
+
 struct Span { // 这个结构类似于 ListNode，因为它是构成 SpanList 的单个结点
     PAGE_ID page_id_ = 0; // 大块内存起始页的页号，一个 Span 包含多个页
     size_t n_ = 0; // 页的数量
     size_t use_count_ = 0; // 将切好的小块内存分给 ThreadCache，use_count_ 记录分出去了多少个小块内存
     bool is_used_ = false;
+    // 空闲的 Span 中已经通过 madvise 把物理内存还给操作系统的页数，再次使用时由内核重新分配物理页
+    // 合并时相加，切分时按页数比例分，不记录具体是哪些页
+    size_t returned_ = 0;
+    size_t free_time_ = 0; // 回到 PageCache 的时间（毫秒），用来判断空闲了多久
     size_t object_size_ = 0; // 存储当前的 Span 所进行服务的对象的大小
+    bool is_direct_ = false; // 整个 Span 直接交给了用户（大对象、按大于一页对齐的申请），释放时整个还给 PageCache
+    bool sampled_ = false; // 直接交给用户的 Span 被堆分析器抽样记录了；抽样的小对象不在任何 Span 上
+    void* owner_ = nullptr; // 最近一次从这个 Span 取走对象的 ThreadCache，定义 CMPOOL_REMOTE_FREE 时使用，只是一个提示
+    unsigned int node_ = 0; // 切成小对象的 Span 挂在哪个 NUMA 节点的 CentralCache 上
     Span* next_ = nullptr; // 双向链表的结构
     Span* prev_ = nullptr;
-    void* free_list_ = nullptr; // 大块内存切成小块并连接起来，这样当 ThreadCache 要的时候直接给它小块的，回收的时候也方便管理
+    // CentralCache 中的 Span 不再把对象串成链表，而是按顺序切（bump），还回来的对象记在位图里
+    // 切 Span 和回收对象都不需要写对象本身，没有用到的页也不会被访问
+    unsigned int capacity_ = 0; // 能切出的对象个数
+    unsigned int carved_ = 0; // 已经按顺序切出去过的对象个数，[carved_, capacity_) 还没有被访问过
+    unsigned long long reciprocal_ = 0; // 2^32 / object_size_ 向上取整，计算对象序号时用乘法代替除法
+    unsigned long long free_bitmap_[SPAN_BITMAP_WORDS] = {}; // 切出去后又还回来的对象，第 i 位为 1 表示第 i 个对象空闲
 };
 
 // 带头的双向循环链表，将每个桶的位置处的多个 Span 连接起来
 class SpanList {
 public:
-    // 构造
-    SpanList() {
-        head_ = new Span;
-        head_->next_ = head_;
-        head_->prev_ = head_;
+    // 构造，头结点直接放在对象里而不是 new 出来，
+    // 这样 CentralCache、PageCache 这些全局对象可以在编译期完成初始化，不依赖全局构造函数的执行顺序
+    constexpr SpanList() {
+        head_.next_ = &head_;
+        head_.prev_ = &head_;
     }
     // 只需要获取到 begin() 和 end()，然后定义一个 Span* 指针就可以完成 SpanList 的遍历
     Span* begin() {
-        return head_->next_; // 带头节点
+        return head_.next_; // 带头节点
     }
     Span* end() {
-        return head_;
+        return &head_;
     }
     // 插入新页
     void insert(Span* pos, Span* new_span) {
@@ -247,7 +429,7 @@ public:
     }
     // 删除
     void erase(Span* pos) {
-        assert(pos != nullptr && pos != head_);
+        assert(pos != nullptr && pos != &head_);
         Span* prev = pos->prev_;
         Span* next = pos->next_;
         prev->next_ = next;
@@ -261,15 +443,15 @@ public:
     }
     // 尾删
     Span* pop_back() {
-        Span* back = end();
+        Span* back = end()->prev_;
         erase(back);
         return back;
     }
     // 判空
     bool empty() {
-        return head_->next_ == head_;
+        return head_.next_ == &head_;
     }
     std::mutex mtx_; // 桶锁: 进到桶里的时候才会加锁
 private:
-    Span* head_ = nullptr;
+    Span head_;
 };
\ No newline at end of file
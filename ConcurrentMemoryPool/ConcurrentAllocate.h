@@ -2,40 +2,278 @@
 
 #include "ThreadCache.h"
 #include "PageCache.h"
-
-static ObjectPool<ThreadCache> tcPool;
+#include "CentralCache.h"
+#include "Scavenger.h"
+#include "Stats.h"
+#include "HeapProfiler.h"
+#ifdef CMPOOL_PER_CPU_CACHE
+#include "CpuCache.h"
+#endif
 
 // 每个线程都有自己的 TLS，不可能让用户自己去调用 TLS 然后才能调到 Allocate，而是应该直接给他们提供接口
+// 使用 inline 而不是 static，所有翻译单元共用同一份定义
 
-static void* concurrent_allocate(size_t size) {
+inline void* allocate_object(size_t size) {
     // 当对象大小 > 256KB 时，放到 new_span 里面处理
     if (size > MAX_BYTES) {
         size_t align_size = SizeClass::round_up(size);
-        PageCache::get_instance()->page_mtx_.lock();
         Span* span = PageCache::get_instance()->new_span(align_size >> PAGE_SHIFT);
-        PageCache::get_instance()->page_mtx_.unlock();
+        // 从 PageCache 桶里切出来的 Span 可能残留着之前的 object_size_ 和 is_direct_，释放时要靠它判断走哪条路径
+        span->object_size_ = align_size;
+        span->is_direct_ = true;
         void* ptr = (void*)(span->page_id_ << PAGE_SHIFT);
         return ptr;
     } else {
-        if (pTLSThreadCache == nullptr) {
-            pTLSThreadCache = tcPool.New();
+#ifdef CMPOOL_PER_CPU_CACHE
+        // 支持 rseq 时走 per-CPU 缓存，否则退回到 ThreadCache
+        if (CpuCache::get_instance()->usable()) {
+            return CpuCache::get_instance()->Allocate(size);
         }
-        return pTLSThreadCache->Allocate(size);
+#endif
+        return get_thread_cache()->Allocate(size);
+    }
+}
+
+// 抽样计数器减到负数时调用，抽中的对象不和普通对象共用 Span
+// 小对象放到堆分析器的抽样区域里（区域用完时这次不抽样），大对象照常申请以后在它独占的 Span 上做标记
+inline void* allocate_sampled(size_t size) {
+    HeapProfiler* profiler = HeapProfiler::get_instance();
+    if (!profiler->should_sample()) {
+        return allocate_object(size);
+    }
+    if (size <= MAX_BYTES) {
+        void* ptr = profiler->allocate_small(size);
+        return ptr != nullptr ? ptr : allocate_object(size);
+    }
+    void* ptr = allocate_object(size);
+    profiler->record_large(ptr, size, PageCache::get_instance()->map_obj_to_span(ptr));
+    return ptr;
+}
+
+inline void* concurrent_allocate(size_t size) {
+    // 堆分析器的抽样: 没有开启时也只是一次减法和一次判断
+    if (__builtin_expect((tls_bytes_until_sample -= (long)size) < 0, 0)) {
+        return allocate_sampled(size);
+    }
+    return allocate_object(size);
+}
+
+// 按 align 对齐时实际申请的大小，align 不超过一页
+// 大小向上取整到 align 的倍数，选出来的桶的对象大小（切分的步长）也一定是 align 的倍数:
+// 桶的大小在每一段内按 8/16/128/1024/8K 递增，比 align 小的步长整除 align，比 align 大的步长是 align 的倍数
+// Span 的起始地址按页对齐，所以每个对象都按 align 对齐，并且这是不小于 size 的、满足对齐的最小的桶
+inline size_t aligned_object_size(size_t size, size_t align) {
+    return align <= 8 ? size : SizeClassRule::round_up_(size, align);
+}
+
+// 按 align 对齐申请 size 字节，align 必须是 2 的幂
+// 不超过一页的对齐选一个合适的桶，和普通的申请走同样的 ThreadCache、CentralCache
+// 超过一页的对齐直接从 PageCache 中切出起始页号按 align 对齐的 Span，不会多占用内存
+inline void* concurrent_allocate_aligned(size_t size, size_t align) {
+    assert(align != 0 && (align & (align - 1)) == 0);
+    if (align <= ((size_t)1 << PAGE_SHIFT)) {
+        size = aligned_object_size(size, align);
+        // 抽样区域的槽位按页对齐，满足不超过一页的对齐
+        if (__builtin_expect((tls_bytes_until_sample -= (long)size) < 0, 0)) {
+            return allocate_sampled(size);
+        }
+        return allocate_object(size);
+    }
+    size_t k = std::max<size_t>(SizeClassRule::round_up_(size, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT, 1);
+    Span* span = PageCache::get_instance()->new_span(k, NumaTopology::get_instance()->current_node(), align >> PAGE_SHIFT);
+    span->object_size_ = k << PAGE_SHIFT;
+    span->is_direct_ = true;
+    void* ptr = (void*)(span->page_id_ << PAGE_SHIFT);
+    if (__builtin_expect((tls_bytes_until_sample -= (long)size) < 0, 0) && HeapProfiler::get_instance()->should_sample()) {
+        HeapProfiler::get_instance()->record_large(ptr, size, span);
+    }
+    return ptr;
+}
+
+// 把小对象放回缓存，span 只在开启 CMPOOL_REMOTE_FREE 时用来找对象属于哪个线程
+inline void free_small_object(void* ptr, size_t size, [[maybe_unused]] Span* span) {
+#ifdef CMPOOL_PER_CPU_CACHE
+    if (CpuCache::get_instance()->usable()) {
+        CpuCache::get_instance()->Deallocate(ptr, size);
+        return;
+    }
+#endif
+#ifdef CMPOOL_REMOTE_FREE
+    // 对象属于别的线程时挂到那个线程的远程释放链表上，由它在下次向 CentralCache 要对象时整条取走
+    // 这样对象不会在线程之间的缓存里来回迁移，只释放不申请的线程也不需要创建 ThreadCache
+    ThreadCache* owner = (ThreadCache*)__atomic_load_n(&span->owner_, __ATOMIC_RELAXED);
+    if (owner != nullptr && owner != pTLSThreadCache && owner->push_remote(SizeClass::index(size), ptr)) {
+        return;
+    }
+    if (pTLSThreadCache == nullptr) {
+        next_obj(ptr) = nullptr;
+        CentralCache::get_instance()->release_range_obj(ptr, ptr, 1, size);
+        return;
     }
+#endif
+    // 只释放不申请的线程也需要一个 ThreadCache
+    get_thread_cache()->Deallocate(ptr, size);
 }
 
-static void concurrent_free(void* ptr) {
-    // 别人可能正在对 id_span_map 进行写入操作，应该等别人写完再读（写入操作只在 new_span 函数中, 而调用 new_span 函数前都会加锁)
-    PageCache::get_instance()->page_mtx_.lock();
+inline void concurrent_free(void* ptr) {
+    // 抽样的小对象不在任何 Span 上，比较一次地址范围就能认出来
+    if (__builtin_expect(HeapProfiler::is_sampled(ptr), 0)) {
+        HeapProfiler::get_instance()->free_small(ptr);
+        return;
+    }
+    // id_span_map_ 是基数树，ptr 所在页的映射在 ptr 被分配出去之前就已经建立好了，读的时候不需要加锁
     Span* span = PageCache::get_instance()->map_obj_to_span(ptr);
-    PageCache::get_instance()->page_mtx_.unlock();
     size_t size = span->object_size_;
-    if (size > MAX_BYTES) { // 大于 NAPES - 1 的情况放到 PageCache 里面处理
-        PageCache::get_instance()->page_mtx_.lock();
+    if (span->is_direct_) { // 大对象和按大于一页对齐的申请，整个 Span 还给 PageCache
+        // 只有被抽样的大对象才去堆分析器的表里查找
+        if (__builtin_expect(span->sampled_, 0)) {
+            HeapProfiler::get_instance()->drop(ptr, span);
+        }
         PageCache::get_instance()->releas_span_to_page(span);
-        PageCache::get_instance()->page_mtx_.unlock();
     } else {
-        assert(pTLSThreadCache);
-        pTLSThreadCache->Deallocate(ptr, size);
+        free_small_object(ptr, size, span);
+    }
+}
+
+// 调用方知道对象大小时使用（例如 C++14 的 sized operator delete）
+// size 必须和申请时传给 concurrent_allocate 的大小一致
+// 小对象直接根据 size 算出桶下标放回线程缓存，不需要通过基数树查找 Span
+inline void concurrent_free_sized(void* ptr, size_t size) {
+    if (size > MAX_BYTES) {
+        concurrent_free(ptr);
+        return;
+    }
+    if (__builtin_expect(HeapProfiler::is_sampled(ptr), 0)) {
+        HeapProfiler::get_instance()->free_small(ptr);
+        return;
+    }
+    assert(PageCache::get_instance()->map_obj_to_span(ptr)->object_size_ == SizeClass::round_up(size));
+#ifdef CMPOOL_REMOTE_FREE
+    // 需要通过 Span 找到对象属于哪个线程
+    free_small_object(ptr, size, PageCache::get_instance()->map_obj_to_span(ptr));
+#else
+    free_small_object(ptr, size, nullptr);
+#endif
+}
+
+// 释放 concurrent_allocate_aligned 申请的内存，size 和 align 必须和申请时一致
+inline void concurrent_free_aligned(void* ptr, size_t size, size_t align) {
+    if (align <= ((size_t)1 << PAGE_SHIFT)) {
+        concurrent_free_sized(ptr, aligned_object_size(size, align));
+    } else {
+        // 按页申请的 Span 大小可能不超过 MAX_BYTES，不能按大小判断，通过 Span 释放
+        concurrent_free(ptr);
+    }
+}
+
+// 把 ptr 的大小调整为 new_size，返回调整后的地址，前 min(原来的大小, new_size) 字节的内容保留
+// 0. 抽样的小对象不原地调整，按新的大小重新申请（可能再次被抽样）
+// 1. 小对象换算以后还是同一个桶，直接返回 ptr
+// 2. 直接交给用户的 Span（大对象、按大于一页对齐的申请）缩小时把尾部的页还给 PageCache，
+//    变大时吞掉后面相邻的空闲页，地址都不变
+// 3. 至少 MREMAP_MIN_PAGES 页的 Span 原地变大失败时用 mremap 换到新的地址，不拷贝内容
+// 4. 其余情况申请新的内存、拷贝、释放原来的
+// ptr 为 nullptr 时相当于 concurrent_allocate；申请失败时抛 std::bad_alloc，ptr 仍然有效
+inline void* concurrent_reallocate(void* ptr, size_t new_size) {
+    if (ptr == nullptr) {
+        return concurrent_allocate(new_size);
     }
-}
\ No newline at end of file
+    if (__builtin_expect(HeapProfiler::is_sampled(ptr), 0)) {
+        size_t old_size = SizeClass::round_up(HeapProfiler::get_instance()->small_size(ptr));
+        void* new_ptr = concurrent_allocate(new_size);
+        memcpy(new_ptr, ptr, std::min(old_size, new_size));
+        HeapProfiler::get_instance()->free_small(ptr);
+        return new_ptr;
+    }
+    Span* span = PageCache::get_instance()->map_obj_to_span(ptr);
+    size_t old_size = span->object_size_;
+    // 直接交给用户的 Span 需要的页数
+    size_t k = std::max<size_t>(SizeClassRule::round_up_(new_size, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT, 1);
+    bool in_place = false;
+    if (!span->is_direct_) {
+        in_place = new_size <= MAX_BYTES && SizeClass::round_up(new_size) == old_size;
+    } else if (k == span->n_ || PageCache::get_instance()->resize_span(span, k)) {
+        span->object_size_ = k << PAGE_SHIFT;
+        in_place = true;
+    }
+    if (in_place) {
+        // 地址不变，抽样记录的大小改成新的大小
+        if (__builtin_expect(span->sampled_, 0)) {
+            HeapProfiler::get_instance()->resize(ptr, new_size);
+        }
+        return ptr;
+    }
+    if (span->is_direct_ && k > span->n_ && span->n_ >= MREMAP_MIN_PAGES) {
+        // 地址会变，先删掉按原来的地址记录的抽样
+        if (__builtin_expect(span->sampled_, 0)) {
+            HeapProfiler::get_instance()->drop(ptr, span);
+        }
+        if (PageCache::get_instance()->remap_span(span, k)) {
+            span->object_size_ = k << PAGE_SHIFT;
+            return (void*)(span->page_id_ << PAGE_SHIFT);
+        }
+    }
+    void* new_ptr = concurrent_allocate(new_size);
+    memcpy(new_ptr, ptr, std::min(old_size, new_size));
+    concurrent_free(ptr);
+    return new_ptr;
+}
+
+// 把 PageCache 中所有空闲 Span 的物理内存立刻还给操作系统，返回还回去的字节数
+inline size_t cmpool_release_free_memory() {
+    for (size_t i = 0; i < NUMA_MAX_NODES; ++i) {
+        CentralCache::get_instance(i)->drain_transfer_cache();
+    }
+    size_t pages = PageCache::get_instance()->release_idle_spans(0);
+    return pages << PAGE_SHIFT;
+}
+
+// 启动后台回收线程，每隔 interval_ms 毫秒把空闲超过 age_ms 毫秒的 Span 还给操作系统
+inline void cmpool_start_scavenger(size_t age_ms, size_t interval_ms = 1000) {
+    Scavenger::get_instance()->start(age_ms, interval_ms);
+}
+
+inline void cmpool_stop_scavenger() {
+    Scavenger::get_instance()->stop();
+}
+
+// 获取内存池的统计信息: 每个桶的申请释放次数、各级缓存中的对象个数、Span 个数和碎片率，以及页堆的使用情况
+inline PoolStats cmpool_get_stats() {
+    PoolStats stats;
+    collect_stats(stats);
+    return stats;
+}
+
+// 以可读的表格输出统计信息
+inline void cmpool_print_stats(std::ostream& os = std::cout) {
+    print_stats(cmpool_get_stats(), os);
+}
+
+// 修改所有线程缓存一共可以占用的字节数，默认 32MB
+inline void cmpool_set_thread_cache_budget(size_t bytes) {
+    ThreadCache::set_budget(bytes);
+}
+
+// 开启堆分析器，平均每申请 sample_bytes 字节抽样一次并记录调用栈
+inline void cmpool_heap_profiler_start(size_t sample_bytes = 512 * 1024) {
+    HeapProfiler::get_instance()->start(sample_bytes);
+}
+
+inline void cmpool_heap_profiler_stop() {
+    HeapProfiler::get_instance()->stop();
+}
+
+// 把还活着的抽样以 pprof 的格式写到 path，可以用 pprof --text <程序> <path> 查看
+inline bool cmpool_dump_heap_profile(const char* path) {
+    return HeapProfiler::get_instance()->dump(path);
+}
+
+// 在单节点的机器上模拟 nodes 个 NUMA 节点，最好在第一次申请内存之前调用
+inline void cmpool_numa_fake_topology(size_t nodes) {
+    NumaTopology::get_instance()->fake(nodes);
+}
+
+// 指定当前线程所在的 NUMA 节点，传 -1 恢复按 CPU 判断
+inline void cmpool_numa_set_thread_node(int node) {
+    NumaTopology::set_thread_node(node);
+}
@@ -0,0 +1,79 @@
+#include "ConcurrentObjectPool.h"
+#include <pthread.h>
+
+__thread int tls_magazine_index = 0;
+
+// 槽位编号在所有对象池之间共用，线程退出时还回来给新线程使用
+static std::mutex index_mtx;
+static int free_indexes[MAGAZINE_THREADS]; // 退出的线程还回来的编号
+static size_t free_index_count = 0;
+static size_t next_index = 0; // 从来没有分出去过的最小编号
+static ConcurrentObjectPoolBase* pool_list = nullptr; // 存活的对象池，由 index_mtx 保护
+static pthread_key_t index_key;
+static pthread_once_t index_key_once = PTHREAD_ONCE_INIT;
+
+static void release_magazine_index(void* ptr) {
+    // 之后这个线程再用对象池时直接访问公共仓库，不会再碰这个槽位
+    tls_magazine_index = -1;
+    std::lock_guard<std::mutex> lock(index_mtx);
+    free_indexes[free_index_count++] = (int)(intptr_t)ptr - 1;
+}
+
+static void create_index_key() {
+    pthread_key_create(&index_key, release_magazine_index);
+}
+
+int assign_magazine_index() {
+    pthread_once(&index_key_once, create_index_key);
+    int index = -1;
+    {
+        std::lock_guard<std::mutex> lock(index_mtx);
+        if (free_index_count > 0) {
+            index = free_indexes[--free_index_count];
+        } else if (next_index < MAGAZINE_THREADS) {
+            index = (int)next_index++;
+        }
+    }
+    tls_magazine_index = index >= 0 ? index + 1 : -1;
+    if (index >= 0) {
+        // 析构函数只在值不为空时调用，所以存编号加一
+        pthread_setspecific(index_key, (void*)(intptr_t)(index + 1));
+    }
+    return index;
+}
+
+ConcurrentObjectPoolBase::ConcurrentObjectPoolBase() {
+    std::lock_guard<std::mutex> lock(index_mtx);
+    next_pool_ = pool_list;
+    if (pool_list != nullptr) {
+        pool_list->prev_pool_ = this;
+    }
+    pool_list = this;
+}
+
+ConcurrentObjectPoolBase::~ConcurrentObjectPoolBase() {
+    std::lock_guard<std::mutex> lock(index_mtx);
+    if (prev_pool_ != nullptr) {
+        prev_pool_->next_pool_ = next_pool_;
+    } else {
+        pool_list = next_pool_;
+    }
+    if (next_pool_ != nullptr) {
+        next_pool_->prev_pool_ = prev_pool_;
+    }
+}
+
+// 持有公共仓库的锁时不会再去拿 index_mtx，先拿 index_mtx 不会死锁
+void ConcurrentObjectPoolBase::lock_all() {
+    index_mtx.lock();
+    for (ConcurrentObjectPoolBase* pool = pool_list; pool != nullptr; pool = pool->next_pool_) {
+        pool->mtx_.lock();
+    }
+}
+
+void ConcurrentObjectPoolBase::unlock_all() {
+    for (ConcurrentObjectPoolBase* pool = pool_list; pool != nullptr; pool = pool->next_pool_) {
+        pool->mtx_.unlock();
+    }
+    index_mtx.unlock();
+}
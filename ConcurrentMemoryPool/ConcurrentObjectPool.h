@@ -0,0 +1,328 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <new>
+#include <utility>
+
+// 多个线程共享的定长对象池
+// ObjectPool 没有加锁，只能由调用方在外面加锁使用（tcPool、span_pool_），这里给需要在线程之间共享的定长对象用
+// 做法和 Solaris 的 magazine 分配器一样:
+// 1. 每个线程在每个池里有一个槽位，槽位上挂着两个弹匣（loaded、previous），弹匣是一个装着空闲对象的定长数组
+// 2. New/Delete 只操作自己槽位上的弹匣，不加锁；loaded 空了（满了）并且 previous 也是空的（满的）时才去公共仓库
+// 3. 公共仓库加锁，里面放着满的弹匣、空的弹匣和从大块内存中切对象的游标，线程一次换一整个弹匣
+// 4. previous 要么是满的、要么是空的，所以线程在一个弹匣的边界上来回申请释放时不会每次都去仓库
+// 线程退出后槽位编号会分给新的线程，槽位上的对象也留给新线程用，不需要在线程退出时清理
+// 对象池析构时还没有 Delete 的对象不会调用析构函数（和 ObjectPool 一样），池必须比使用它的线程活得久
+
+// 每个池最多给这么多个线程分配槽位，更多的线程直接加锁访问公共仓库
+static const size_t MAGAZINE_THREADS = 256;
+
+// 当前线程的槽位编号加一，0 表示还没有分配，-1 表示没有槽位（线程太多或者正在退出）
+extern __thread int tls_magazine_index;
+// 给当前线程分配槽位编号，没有空闲编号时返回 -1
+int assign_magazine_index();
+
+inline int magazine_thread_index() {
+    int i = tls_magazine_index;
+    if (__builtin_expect(i > 0, 1)) {
+        return i - 1;
+    }
+    return i < 0 ? -1 : assign_magazine_index();
+}
+
+// 所有对象池共用的部分: 公共仓库的锁，以及把存活的对象池串起来的链表，fork 时逐个加锁
+class ConcurrentObjectPoolBase {
+public:
+    // fork 前后对槽位编号和所有对象池的公共仓库加锁、解锁，保证子进程中这些锁是可用的
+    static void lock_all();
+    static void unlock_all();
+protected:
+    ConcurrentObjectPoolBase();
+    ~ConcurrentObjectPoolBase();
+    ConcurrentObjectPoolBase(const ConcurrentObjectPoolBase&) = delete;
+    ConcurrentObjectPoolBase& operator=(const ConcurrentObjectPoolBase&) = delete;
+
+    std::mutex mtx_; // 保护派生类中的公共仓库
+private:
+    // 存活的对象池串成双向链表，由槽位编号的锁保护
+    ConcurrentObjectPoolBase* next_pool_ = nullptr;
+    ConcurrentObjectPoolBase* prev_pool_ = nullptr;
+};
+
+template <class T, size_t MAGAZINE_SIZE = 64>
+class ConcurrentObjectPool : private ConcurrentObjectPoolBase {
+    static_assert(alignof(T) <= ((size_t)1 << PAGE_SHIFT), "ConcurrentObjectPool: alignment larger than a page");
+    static_assert(MAGAZINE_SIZE > 0, "ConcurrentObjectPool: empty magazine");
+public:
+    ConcurrentObjectPool() = default;
+    ConcurrentObjectPool(const ConcurrentObjectPool&) = delete;
+    ConcurrentObjectPool& operator=(const ConcurrentObjectPool&) = delete;
+
+    ~ConcurrentObjectPool() {
+        // 弹匣和对象都是从大块内存中切出来的，一起还给操作系统
+        while (chunks_ != nullptr) {
+            Chunk* next = chunks_->next_;
+            system_free(chunks_, chunks_->bytes_);
+            chunks_ = next;
+        }
+        Slot* slots = slots_.load(std::memory_order_relaxed);
+        if (slots != nullptr) {
+            system_free(slots, SLOT_PAGES << PAGE_SHIFT);
+        }
+    }
+
+    // 用 args 构造一个对象
+    template <class... Args>
+    T* New(Args&&... args) {
+        void* obj = alloc_block();
+        try {
+            return new(obj) T(std::forward<Args>(args)...);
+        } catch (...) {
+            free_block(obj);
+            throw;
+        }
+    }
+
+    void Delete(T* obj) {
+        obj->~T();
+        free_block(obj);
+    }
+
+    // 申请 n 个对象放到 objs 中，每个对象都用 args 构造，参数会被拷贝所以不做转发
+    // 某个构造函数抛异常时，已经构造好的对象会被析构，所有内存还回池中
+    template <class... Args>
+    void NewN(T** objs, size_t n, const Args&... args) {
+        Slot* slot = my_slot();
+        for (size_t i = 0; i < n; ++i) {
+            objs[i] = (T*)(slot != nullptr ? pop_block(slot) : depot_pop());
+        }
+        size_t built = 0;
+        try {
+            for (; built < n; ++built) {
+                new(objs[built]) T(args...);
+            }
+        } catch (...) {
+            for (size_t i = 0; i < built; ++i) {
+                objs[i]->~T();
+            }
+            release_blocks(slot, (void* const*)objs, n);
+            throw;
+        }
+    }
+
+    void DeleteN(T* const* objs, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            objs[i]->~T();
+        }
+        release_blocks(my_slot(), (void* const*)objs, n);
+    }
+
+private:
+    // 对象至少要能放下一个指针（公共仓库的自由链表），并且按 alignof(T) 对齐
+    static constexpr size_t OBJ_SIZE =
+        ((sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T)) + alignof(T) - 1) & ~(alignof(T) - 1);
+    static constexpr size_t CHUNK_BYTES = 128 * 1024;
+
+    struct Magazine {
+        Magazine* next_ = nullptr; // 在公共仓库中时链接满的或空的弹匣
+        size_t count_ = 0;
+        void* objs_[MAGAZINE_SIZE];
+    };
+    // 每个槽位独占一个缓存行，不同线程的槽位不会伪共享
+    struct alignas(64) Slot {
+        Magazine* loaded_;
+        Magazine* previous_;
+    };
+    // 每块大内存的头部，析构时通过它找到所有大块内存
+    struct Chunk {
+        Chunk* next_;
+        size_t bytes_;
+    };
+    static constexpr size_t SLOT_PAGES = (sizeof(Slot) * MAGAZINE_THREADS + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+
+    void* alloc_block() {
+        Slot* slot = my_slot();
+        return slot != nullptr ? pop_block(slot) : depot_pop();
+    }
+
+    void free_block(void* obj) {
+        Slot* slot = my_slot();
+        if (slot != nullptr) {
+            push_block(slot, obj);
+        } else {
+            depot_push(obj);
+        }
+    }
+
+    void release_blocks(Slot* slot, void* const* objs, size_t n) {
+        if (slot != nullptr) {
+            for (size_t i = 0; i < n; ++i) {
+                push_block(slot, objs[i]);
+            }
+        } else {
+            std::lock_guard<std::mutex> lock(mtx_);
+            for (size_t i = 0; i < n; ++i) {
+                next_obj(objs[i]) = free_list_;
+                free_list_ = objs[i];
+            }
+        }
+    }
+
+    // 当前线程的槽位，没有槽位时返回 nullptr
+    Slot* my_slot() {
+        int i = magazine_thread_index();
+        if (i < 0) {
+            return nullptr;
+        }
+        Slot* slots = slots_.load(std::memory_order_acquire);
+        if (__builtin_expect(slots == nullptr, 0)) {
+            slots = install_slots();
+        }
+        Slot* slot = &slots[i];
+        if (__builtin_expect(slot->loaded_ == nullptr, 0)) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            slot->loaded_ = take_empty();
+            slot->previous_ = take_empty();
+        }
+        return slot;
+    }
+
+    // 槽位数组在第一次用到时才申请，多个线程同时申请时失败的一方释放自己的
+    Slot* install_slots() {
+        Slot* fresh = (Slot*)system_alloc(SLOT_PAGES);
+        if (fresh == nullptr) {
+            throw std::bad_alloc();
+        }
+        Slot* expected = nullptr;
+        if (slots_.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+            return fresh;
+        }
+        system_free(fresh, SLOT_PAGES << PAGE_SHIFT);
+        return expected;
+    }
+
+    void* pop_block(Slot* slot) {
+        if (slot->loaded_->count_ == 0) {
+            reload(slot);
+        }
+        return slot->loaded_->objs_[--slot->loaded_->count_];
+    }
+
+    void push_block(Slot* slot, void* obj) {
+        if (slot->loaded_->count_ == MAGAZINE_SIZE) {
+            unload(slot);
+        }
+        slot->loaded_->objs_[slot->loaded_->count_++] = obj;
+    }
+
+    // loaded 空了: previous 是满的就交换，否则把 previous 换成仓库里满的弹匣，仓库也没有时直接装满 loaded
+    void reload(Slot* slot) {
+        if (slot->previous_->count_ > 0) {
+            std::swap(slot->loaded_, slot->previous_);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (full_ != nullptr) {
+            Magazine* mag = full_;
+            full_ = mag->next_;
+            slot->previous_->next_ = empty_;
+            empty_ = slot->previous_;
+            slot->previous_ = slot->loaded_;
+            slot->loaded_ = mag;
+            return;
+        }
+        Magazine* mag = slot->loaded_;
+        while (mag->count_ < MAGAZINE_SIZE) {
+            mag->objs_[mag->count_++] = depot_pop_locked();
+        }
+    }
+
+    // loaded 满了: previous 是空的就交换，否则把 previous 放进仓库，换一个空弹匣回来
+    void unload(Slot* slot) {
+        if (slot->previous_->count_ == 0) {
+            std::swap(slot->loaded_, slot->previous_);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        slot->previous_->next_ = full_;
+        full_ = slot->previous_;
+        slot->previous_ = slot->loaded_;
+        slot->loaded_ = take_empty();
+    }
+
+    void* depot_pop() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return depot_pop_locked();
+    }
+
+    void depot_push(void* obj) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        next_obj(obj) = free_list_;
+        free_list_ = obj;
+    }
+
+    // 下面的函数都需要持有 mtx_
+    // 先用没有槽位的线程还回来的对象，再从满的弹匣里拿，最后从大块内存中切
+    void* depot_pop_locked() {
+        if (free_list_ != nullptr) {
+            void* obj = free_list_;
+            free_list_ = next_obj(obj);
+            return obj;
+        }
+        if (full_ != nullptr) {
+            Magazine* mag = full_;
+            void* obj = mag->objs_[--mag->count_];
+            if (mag->count_ == 0) {
+                full_ = mag->next_;
+                mag->next_ = empty_;
+                empty_ = mag;
+            }
+            return obj;
+        }
+        return carve(OBJ_SIZE, alignof(T));
+    }
+
+    Magazine* take_empty() {
+        if (empty_ != nullptr) {
+            Magazine* mag = empty_;
+            empty_ = mag->next_;
+            mag->next_ = nullptr;
+            return mag;
+        }
+        return new(carve(sizeof(Magazine), alignof(Magazine))) Magazine;
+    }
+
+    // 从大块内存中切出 bytes 字节，起始地址按 align 对齐，剩余的不够时重新申请一块
+    void* carve(size_t bytes, size_t align) {
+        size_t pad = (align - ((size_t)memory_ & (align - 1))) & (align - 1);
+        if (memory_ == nullptr || remain_bytes_ < pad + bytes) {
+            size_t need = sizeof(Chunk) + align + bytes;
+            size_t chunk_bytes = need < CHUNK_BYTES ? CHUNK_BYTES : need;
+            size_t kpage = (chunk_bytes + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+            Chunk* chunk = (Chunk*)system_alloc(kpage);
+            if (chunk == nullptr) {
+                throw std::bad_alloc();
+            }
+            chunk->bytes_ = kpage << PAGE_SHIFT;
+            chunk->next_ = chunks_;
+            chunks_ = chunk;
+            memory_ = (char*)(chunk + 1);
+            remain_bytes_ = chunk->bytes_ - sizeof(Chunk);
+            pad = (align - ((size_t)memory_ & (align - 1))) & (align - 1);
+        }
+        void* ptr = memory_ + pad;
+        memory_ += pad + bytes;
+        remain_bytes_ -= pad + bytes;
+        return ptr;
+    }
+
+    std::atomic<Slot*> slots_{nullptr}; // 每个线程的槽位，按 magazine_thread_index 下标
+    // 下面的公共仓库由 mtx_ 保护
+    Magazine* full_ = nullptr; // 满的弹匣
+    Magazine* empty_ = nullptr; // 空的弹匣
+    void* free_list_ = nullptr; // 没有槽位的线程还回来的对象
+    char* memory_ = nullptr; // 当前大块内存中还没切的部分
+    size_t remain_bytes_ = 0;
+    Chunk* chunks_ = nullptr; // 所有申请过的大块内存
+};
@@ -0,0 +1,144 @@
+// 标准库容器的性能测试，对比 std::allocator、__gnu_cxx::__pool_alloc、cmpool::allocator 和 cmpool::pool_resource
+//   g++ -std=c++17 -O2 -pthread CentralCache.cpp PageCache.cpp ThreadCache.cpp CpuCache.cpp Scavenger.cpp Stats.cpp HeapProfiler.cpp Numa.cpp ContainerBenchmark.cpp -o container_benchmark
+//   ./container_benchmark [--threads N] [--ops N]
+// 每个线程各自有一个容器，随机插入、删除键，容器大小维持在 10000 个元素左右
+// 每行输出一个组合: 分配器、容器、线程数、总操作次数、耗时和吞吐量（ops/s），CSV 格式
+
+#include "Allocator.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ext/pool_allocator.h>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+static size_t ops = 1000000; // 每个线程的操作次数
+static size_t max_threads = max(1u, thread::hardware_concurrency());
+static const size_t KEYS = 20000; // 键的范围，容器里大约有一半
+
+// 对每种分配器生成三种容器，pmr 版本的容器在构造时传入内存资源
+template <template <class> class Alloc>
+struct Containers {
+    using Map = map<int, int, less<int>, Alloc<pair<const int, int>>>;
+    using List = list<int, Alloc<int>>;
+    using Hash = unordered_map<int, int, hash<int>, equal_to<int>, Alloc<pair<const int, int>>>;
+    template <class C>
+    static C make() {
+        return C();
+    }
+};
+
+template <class T>
+using PmrAlloc = pmr::polymorphic_allocator<T>;
+
+template <>
+template <class C>
+C Containers<PmrAlloc>::make() {
+    return C(typename C::allocator_type(cmpool::get_pool_resource()));
+}
+
+// map 和 unordered_map: 随机的键不在就插入，在就删除
+template <class C>
+void churn_map(C& c, size_t id) {
+    mt19937 rng(id + 1);
+    for (size_t i = 0; i < ops; ++i) {
+        int key = rng() % KEYS;
+        auto it = c.find(key);
+        if (it == c.end()) {
+            c.emplace(key, key);
+        } else {
+            c.erase(it);
+        }
+    }
+}
+
+// list: 长度不到一半时在头部或尾部插入，否则从头部或尾部删除
+template <class C>
+void churn_list(C& c, size_t id) {
+    mt19937 rng(id + 1);
+    for (size_t i = 0; i < ops; ++i) {
+        bool front = rng() & 1;
+        if (c.size() < KEYS / 2 || (rng() & 1)) {
+            front ? c.push_front((int)i) : c.push_back((int)i);
+        } else {
+            front ? c.pop_front() : c.pop_back();
+        }
+    }
+}
+
+template <template <class> class Alloc>
+double run(const string& container, size_t nthreads) {
+    using CS = Containers<Alloc>;
+    auto body = [&](size_t id) {
+        if (container == "map") {
+            auto c = CS::template make<typename CS::Map>();
+            churn_map(c, id);
+        } else if (container == "list") {
+            auto c = CS::template make<typename CS::List>();
+            churn_list(c, id);
+        } else {
+            auto c = CS::template make<typename CS::Hash>();
+            churn_map(c, id);
+        }
+    };
+    auto begin = chrono::steady_clock::now();
+    vector<thread> ths;
+    for (size_t i = 0; i < nthreads; ++i) {
+        ths.emplace_back(body, i);
+    }
+    for (auto& t : ths) {
+        t.join();
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            max_threads = max(1, atoi(argv[++i]));
+        } else if (arg == "--ops" && i + 1 < argc) {
+            ops = max(1000, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--ops N]\n", argv[0]);
+            return 1;
+        }
+    }
+    vector<size_t> thread_counts;
+    for (size_t n = 1; n < max_threads; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(max_threads);
+
+    const vector<string> containers = { "map", "list", "unordered_map" };
+    const char* names[] = { "std::allocator", "__pool_alloc", "cmpool::allocator", "pool_resource" };
+    printf("allocator,container,threads,ops,seconds,ops_per_sec\n");
+    for (const string& container : containers) {
+        for (size_t nthreads : thread_counts) {
+            for (int which = 0; which < 4; ++which) {
+                double seconds = 0;
+                if (which == 0) {
+                    seconds = run<std::allocator>(container, nthreads);
+                } else if (which == 1) {
+                    seconds = run<__gnu_cxx::__pool_alloc>(container, nthreads);
+                } else if (which == 2) {
+                    seconds = run<cmpool::allocator>(container, nthreads);
+                } else {
+                    seconds = run<PmrAlloc>(container, nthreads);
+                }
+                size_t total = ops * nthreads;
+                printf("%s,%s,%zu,%zu,%.6f,%.0f\n", names[which], container.c_str(), nthreads, total, seconds,
+                       seconds > 0 ? total / seconds : 0);
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
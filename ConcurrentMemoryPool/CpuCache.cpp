@@ -0,0 +1,214 @@
+#include "CpuCache.h"
+#include "CentralCache.h"
+#include "Stats.h"
+
+#if defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define CMPOOL_HAVE_RSEQ 1
+#endif
+
+CpuCache CpuCache::inst_;
+
+#ifdef CMPOOL_HAVE_RSEQ
+
+// glibc 2.35 以后会为每个线程注册 rseq，注册区域位于线程指针 + __rseq_offset
+static inline struct rseq* rseq_area() {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+bool CpuCache::usable() {
+    if (__rseq_size == 0 || (int)((volatile struct rseq*)rseq_area())->cpu_id < 0) {
+        return false;
+    }
+    if (slabs_ == nullptr) {
+        init();
+    }
+    return true;
+}
+
+// 下面两段汇编都是 rseq 临界区:
+// 6: 把临界区描述符（3:）的地址写进 rseq_cs，告诉内核临界区的范围
+// 1: 临界区开始，读 cpu_id 并定位到这个 CPU 的 slab
+// 2: 临界区结束，最后一条指令写回 count 就是提交点
+// 4: 临界区被抢占、迁移或者被信号打断时，内核把执行流改到这里，重新从 6: 开始执行
+//    它前面的 4 个字节必须是 glibc 注册 rseq 时使用的签名 0x53053053
+#define RSEQ_CS_DEFINE                                                  \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                \
+    ".balign 32\n\t"                                                    \
+    "3:\n\t"                                                            \
+    ".long 0x0, 0x0\n\t"                                                \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                       \
+    ".popsection\n\t"                                                   \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                           \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                        \
+    ".long 0x53053053\n\t"                                              \
+    "4:\n\t"                                                            \
+    "jmp 6f\n\t"                                                        \
+    ".popsection\n\t"                                                   \
+    "6:\n\t"                                                            \
+    "leaq 3b(%%rip), %[slab]\n\t"                                       \
+    "movq %[slab], 8(%[rseq])\n\t"                                      \
+    "1:\n\t"                                                            \
+    "movl 4(%[rseq]), %k[slab]\n\t"                                     \
+    "shlq %[shift], %[slab]\n\t"                                        \
+    "addq %[base], %[slab]\n\t"                                         \
+    "movl (%[slab], %[index], 4), %k[count]\n\t"
+
+void* CpuCache::pop(size_t index) {
+    // 该桶指针数组的起始地址减去一个指针的大小，栈顶元素为 objs[count - 1]
+    size_t offset = CpuCacheLayout::HEADER_BYTES + sizeof(void*) * layout_.begin[index] - sizeof(void*);
+    void* obj;
+    size_t slab;
+    size_t count;
+    asm volatile(
+        RSEQ_CS_DEFINE
+        "xorl %k[obj], %k[obj]\n\t"
+        "testl %k[count], %k[count]\n\t"
+        "jz 2f\n\t"
+        "leaq (%[slab], %[offset]), %[obj]\n\t"
+        "movq (%[obj], %[count], 8), %[obj]\n\t"
+        "decl %k[count]\n\t"
+        "movl %k[count], (%[slab], %[index], 4)\n\t"
+        "2:\n\t"
+        : [obj] "=&r"(obj), [slab] "=&r"(slab), [count] "=&r"(count)
+        : [rseq] "r"(rseq_area()), [base] "r"(slabs_), [shift] "i"(SLAB_SHIFT),
+          [index] "r"(index), [offset] "r"(offset)
+        : "memory", "cc");
+    return obj;
+}
+
+bool CpuCache::push(size_t index, void* obj) {
+    size_t offset = CpuCacheLayout::HEADER_BYTES + sizeof(void*) * layout_.begin[index];
+    size_t capacity = layout_.capacity[index];
+    size_t ok;
+    size_t slab;
+    size_t count;
+    asm volatile(
+        RSEQ_CS_DEFINE
+        "cmpl %k[capacity], %k[count]\n\t"
+        "jae 5f\n\t"
+        "leaq (%[slab], %[offset]), %[ok]\n\t"
+        "movq %[obj], (%[ok], %[count], 8)\n\t"
+        "incl %k[count]\n\t"
+        "movl %k[count], (%[slab], %[index], 4)\n\t"
+        "2:\n\t"
+        "movl $1, %k[ok]\n\t"
+        "jmp 7f\n\t"
+        "5:\n\t"
+        "xorl %k[ok], %k[ok]\n\t"
+        "7:\n\t"
+        : [ok] "=&r"(ok), [slab] "=&r"(slab), [count] "=&r"(count)
+        : [rseq] "r"(rseq_area()), [base] "r"(slabs_), [shift] "i"(SLAB_SHIFT),
+          [index] "r"(index), [offset] "r"(offset), [capacity] "r"(capacity), [obj] "r"(obj)
+        : "memory", "cc");
+    return ok != 0;
+}
+
+#undef RSEQ_CS_DEFINE
+
+#else
+
+// 不支持 rseq 的平台上始终退回到 ThreadCache
+bool CpuCache::usable() {
+    return false;
+}
+
+void* CpuCache::pop([[maybe_unused]] size_t index) {
+    assert(false);
+    return nullptr;
+}
+
+bool CpuCache::push([[maybe_unused]] size_t index, [[maybe_unused]] void* obj) {
+    assert(false);
+    return false;
+}
+
+#endif
+
+void CpuCache::init() {
+    std::lock_guard<std::mutex> lock(init_mtx_);
+    if (slabs_ != nullptr) {
+        return;
+    }
+    // 按系统配置的 CPU 数申请，cpu_id 不会超过这个范围
+    // mmap 出来的内存在第一次访问时才分配物理页，没有用到的 CPU 不占内存，count 初始都为 0
+    size_t ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    char* slabs = (char*)system_alloc((ncpu << SLAB_SHIFT) >> PAGE_SHIFT);
+    ncpu_ = ncpu;
+    __atomic_store_n(&slabs_, slabs, __ATOMIC_RELEASE);
+}
+
+void* CpuCache::Allocate(size_t size) {
+    assert(size <= MAX_BYTES);
+    size_t index = SizeClass::index(size);
+    void* obj = pop(index);
+    if (obj != nullptr) {
+        return obj;
+    }
+    return fetch_from_central_cache(index, SizeClass::bytes(index));
+}
+
+void* CpuCache::fetch_from_central_cache(size_t index, size_t size) {
+    // 一次取半个缓存的量，申请和释放交替时不会每次都去访问 CentralCache
+    size_t batch_num = std::max<size_t>(1, layout_.capacity[index] / 2);
+    void* start = nullptr;
+    void* end = nullptr;
+    size_t actual_num = CentralCache::get_instance()->fetch_range_obj(start, end, batch_num, size);
+    assert(actual_num > 0);
+    // 第一个对象直接返回，剩下的放进当前 CPU 的缓存
+    void* obj = start;
+    void* cur = next_obj(start);
+    while (cur != nullptr) {
+        void* next = next_obj(cur);
+        // 等待期间其他线程可能已经把缓存填满了，放不下的还给 CentralCache
+        if (!push(index, cur)) {
+            CentralCache::get_instance()->release_list_to_spans(cur, size);
+            break;
+        }
+        cur = next;
+    }
+    return obj;
+}
+
+void CpuCache::Deallocate(void* ptr, size_t size) {
+    assert(ptr && size <= MAX_BYTES);
+    size_t index = SizeClass::index(size);
+    while (!push(index, ptr)) {
+        list_too_long(index, SizeClass::bytes(index));
+    }
+}
+
+void CpuCache::list_too_long(size_t index, size_t size) {
+    // 取出半个缓存的对象串成链表，还给 CentralCache
+    size_t batch_num = std::max<size_t>(1, layout_.capacity[index] / 2);
+    void* list = nullptr;
+    void* end = nullptr;
+    size_t n = 0;
+    for (; n < batch_num; ++n) {
+        void* obj = pop(index);
+        if (obj == nullptr) {
+            break;
+        }
+        if (list == nullptr) {
+            end = obj;
+        }
+        next_obj(obj) = list;
+        list = obj;
+    }
+    if (list != nullptr) {
+        CentralCache::get_instance()->release_range_obj(list, end, n, size);
+    }
+}
+
+void CpuCache::collect_stats(PoolStats& stats) {
+    char* slabs = __atomic_load_n(&slabs_, __ATOMIC_ACQUIRE);
+    if (slabs == nullptr) {
+        return;
+    }
+    for (size_t cpu = 0; cpu < ncpu_; ++cpu) {
+        unsigned int* counts = (unsigned int*)(slabs + (cpu << SLAB_SHIFT));
+        for (size_t i = 0; i < NFREELISTS; ++i) {
+            stats.classes[i].thread_cache_objects += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+        }
+    }
+}
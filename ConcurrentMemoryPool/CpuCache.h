@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Common.h"
+
+// 按 CPU 划分的前端缓存，编译时定义 CMPOOL_PER_CPU_CACHE 后 concurrent_allocate/concurrent_free 优先走这里
+// ThreadCache 每个线程一份，线程很多时缓存的内存会随线程数增长；CpuCache 每个 CPU 一份，只随核数增长
+// 同一个 CPU 上同一时刻只有一个线程在运行，借助 Linux 的 rseq（restartable sequences），
+// 读 cpu_id、修改该 CPU 的缓存这一段操作如果被抢占或迁移到别的 CPU，内核会让它从头重来，所以 push/pop 不需要原子操作和锁
+// 内核或 glibc 不支持 rseq 时 usable() 返回 false，调用方退回到 ThreadCache
+
+// 每个 CPU 上每个桶最多缓存多少字节
+static const size_t PER_CPU_CLASS_BYTES = 64 * 1024;
+
+// 每个 CPU 的缓存区（slab）的布局，编译期计算
+// [count[0], count[1], ..., count[NFREELISTS-1]] [桶 0 的对象指针数组][桶 1 的对象指针数组]...
+struct CpuCacheLayout {
+    static const size_t HEADER_BYTES = (NFREELISTS * sizeof(unsigned int) + 63) & ~(size_t)63;
+
+    constexpr CpuCacheLayout() : begin(), capacity(), total(0) {
+        for (size_t i = 0; i < NFREELISTS; ++i) {
+            size_t size = SizeClassRule::bytes(i);
+            size_t cap = PER_CPU_CLASS_BYTES / size;
+            if (cap < 1) {
+                cap = 1;
+            }
+            // 容量不超过一次批量移动的上限，和 ThreadCache 与 CentralCache 之间的批量约定保持一致
+            if (cap > SizeClassRule::num_move_size(size)) {
+                cap = SizeClassRule::num_move_size(size);
+            }
+            begin[i] = total;
+            capacity[i] = cap;
+            total += cap;
+        }
+    }
+
+    unsigned int begin[NFREELISTS]; // 每个桶的指针数组在 slab 中的起始下标
+    unsigned int capacity[NFREELISTS]; // 每个桶最多缓存多少个对象
+    size_t total; // 所有桶的指针总数
+};
+
+struct PoolStats;
+
+class CpuCache {
+public:
+    static CpuCache* get_instance() {
+        return &inst_;
+    }
+    // 当前线程能否使用 per-CPU 缓存
+    bool usable();
+    // 申请和释放内存对象
+    void* Allocate(size_t size);
+    void Deallocate(void* ptr, size_t size);
+    // 统计所有 CPU 的缓存中的对象个数
+    void collect_stats(PoolStats& stats);
+private:
+    CpuCache() = default;
+    CpuCache(const CpuCache&) = delete;
+    CpuCache& operator=(const CpuCache&) = delete;
+    // 从中心缓存获取一批对象，留一个返回，其余放进当前 CPU 的缓存
+    void* fetch_from_central_cache(size_t index, size_t size);
+    // 当前 CPU 的缓存满了，取出一批还给中心缓存
+    void list_too_long(size_t index, size_t size);
+    // 在当前 CPU 的缓存上执行的 rseq 操作，失败（空或满）时分别返回 nullptr 和 false
+    void* pop(size_t index);
+    bool push(size_t index, void* obj);
+    // 为所有 CPU 申请 slab
+    void init();
+
+    static CpuCache inst_;
+    static constexpr CpuCacheLayout layout_{};
+    static const size_t SLAB_SHIFT = 18; // 每个 CPU 的 slab 为 256KB
+    static_assert(CpuCacheLayout::HEADER_BYTES + sizeof(void*) * CpuCacheLayout().total <= ((size_t)1 << SLAB_SHIFT),
+                  "per-CPU slab 放不下所有桶");
+
+    char* slabs_ = nullptr; // 所有 CPU 的 slab 连续存放，第 i 个 CPU 的 slab 起始地址为 slabs_ + (i << SLAB_SHIFT)
+    size_t ncpu_ = 0;
+    std::mutex init_mtx_;
+};
@@ -0,0 +1,264 @@
+#include "HeapProfiler.h"
+#include "PageCache.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <execinfo.h>
+
+HeapProfiler HeapProfiler::inst_;
+uintptr_t HeapProfiler::region_begin_ = 0;
+size_t HeapProfiler::region_bytes_ = 0;
+
+__thread long tls_bytes_until_sample = 0;
+// 每个线程自己的随机数状态，0 表示还没有初始化
+static __thread unsigned long long tls_rng = 0;
+// 记录调用栈的过程中（backtrace 第一次调用时可能申请内存）不再抽样，防止递归
+static __thread bool tls_in_sampler = false;
+
+void HeapProfiler::start(size_t sample_bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (table_ == nullptr) {
+            table_ = (Sample**)system_alloc((TABLE_SIZE * sizeof(Sample*) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+            reserve_region();
+        }
+    }
+    // backtrace 第一次调用时会加载 libgcc_s，可能申请内存，先在这里调一次
+    void* stack[1];
+    tls_in_sampler = true;
+    backtrace(stack, 1);
+    tls_in_sampler = false;
+    sample_bytes_ = sample_bytes == 0 ? 1 : sample_bytes;
+    enabled_ = true;
+}
+
+void HeapProfiler::stop() {
+    // 已有的记录保留，释放时照常删除
+    enabled_ = false;
+}
+
+long HeapProfiler::next_interval() {
+    if (tls_rng == 0) {
+        tls_rng = (unsigned long long)&tls_rng ^
+                  (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count() ^ 0x9E3779B97F4A7C15ull;
+    }
+    // xorshift64*
+    tls_rng ^= tls_rng >> 12;
+    tls_rng ^= tls_rng << 25;
+    tls_rng ^= tls_rng >> 27;
+    unsigned long long r = tls_rng * 2685821657736338717ull;
+    // 取高 53 位得到 (0, 1] 之间的均匀分布
+    double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double interval = -std::log(u) * sample_bytes_.load(std::memory_order_relaxed);
+    return interval < 1 ? 1 : (long)std::min(interval, 1e15);
+}
+
+void HeapProfiler::reserve_region() {
+    // 只保留地址空间，不占物理内存也不计入 overcommit，用到的页才会分配物理页
+    for (size_t bytes = REGION_BYTES; bytes >= ((size_t)64 << 20); bytes >>= 1) {
+        void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr != MAP_FAILED) {
+            size_t slots = bytes / SLOT_BYTES;
+            free_slots_ = (unsigned int*)system_alloc((slots * sizeof(unsigned int) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+            // 先写起始地址再写长度，is_sampled 读到新长度时一定也能读到新地址
+            __atomic_store_n(&region_begin_, (uintptr_t)ptr, __ATOMIC_RELAXED);
+            __atomic_store_n(&region_bytes_, bytes, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    // 地址空间不够时小对象不抽样，大对象照常抽样
+}
+
+bool HeapProfiler::should_sample() {
+    if (!enabled_.load(std::memory_order_relaxed)) {
+        tls_bytes_until_sample = RECHECK_BYTES;
+        return false;
+    }
+    tls_bytes_until_sample = next_interval();
+    return !tls_in_sampler;
+}
+
+void HeapProfiler::insert(void* ptr, size_t size, void* const* stack, int depth) {
+    Sample*& head = table_[hash(ptr)];
+    Sample* sample = sample_pool_.New();
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->depth = std::min<size_t>(depth < 0 ? 0 : depth, (size_t)MAX_DEPTH);
+    std::copy(stack, stack + sample->depth, sample->stack);
+    sample->next = head;
+    head = sample;
+    ++live_samples_;
+}
+
+HeapProfiler::Sample* HeapProfiler::remove(void* ptr) {
+    for (Sample** it = &table_[hash(ptr)]; *it != nullptr; it = &(*it)->next) {
+        if ((*it)->ptr == ptr) {
+            Sample* sample = *it;
+            *it = sample->next;
+            --live_samples_;
+            return sample;
+        }
+    }
+    return nullptr;
+}
+
+void* HeapProfiler::allocate_small(size_t size) {
+    tls_in_sampler = true;
+    void* stack[MAX_DEPTH + 2];
+    // 跳过 allocate_small 自己这一层
+    int depth = backtrace(stack, MAX_DEPTH + 2) - 1;
+    void* ptr = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        size_t slot;
+        if (free_slot_count_ > 0) {
+            slot = free_slots_[--free_slot_count_];
+        } else if (next_slot_ < region_bytes_ / SLOT_BYTES) {
+            slot = next_slot_++;
+        } else {
+            tls_in_sampler = false;
+            return nullptr;
+        }
+        ptr = (void*)(region_begin_ + slot * SLOT_BYTES);
+        insert(ptr, size, stack + 1, depth);
+    }
+    tls_in_sampler = false;
+    return ptr;
+}
+
+void HeapProfiler::free_small(void* ptr) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Sample* sample = remove(ptr);
+    assert(sample != nullptr);
+    // 槽位以后还会被别的抽样使用，把用过的页还给操作系统，下次拿到的也是清零的页
+    system_release(ptr, SizeClassRule::round_up_(SizeClass::round_up(sample->size), (size_t)1 << PAGE_SHIFT));
+    sample_pool_.Delete(sample);
+    free_slots_[free_slot_count_++] = (unsigned int)(((uintptr_t)ptr - region_begin_) / SLOT_BYTES);
+}
+
+size_t HeapProfiler::small_size(void* ptr) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (Sample* it = table_[hash(ptr)]; it != nullptr; it = it->next) {
+        if (it->ptr == ptr) {
+            return it->size;
+        }
+    }
+    assert(false);
+    return 0;
+}
+
+void HeapProfiler::record_large(void* ptr, size_t size, Span* span) {
+    tls_in_sampler = true;
+    void* stack[MAX_DEPTH + 2];
+    // 跳过 record_large 自己这一层
+    int depth = backtrace(stack, MAX_DEPTH + 2) - 1;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        insert(ptr, size, stack + 1, depth);
+        // 大对象独占这个 Span，标记只被它的申请和释放读写
+        span->sampled_ = true;
+    }
+    tls_in_sampler = false;
+}
+
+void HeapProfiler::drop(void* ptr, Span* span) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Sample* sample = remove(ptr);
+    if (sample != nullptr) {
+        sample_pool_.Delete(sample);
+    }
+    span->sampled_ = false;
+}
+
+void HeapProfiler::resize(void* ptr, size_t size) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (Sample* it = table_[hash(ptr)]; it != nullptr; it = it->next) {
+        if (it->ptr == ptr) {
+            it->size = size;
+            return;
+        }
+    }
+}
+
+// 写文件不能用 stdio 的缓冲区（会申请内存），格式化到栈上的缓冲区再 write
+static bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool HeapProfiler::dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    char line[64 + MAX_DEPTH * 20];
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        size_t n = live_samples_.load();
+        Sample** samples = nullptr;
+        size_t pages = 0;
+        if (n > 0) {
+            // 按调用栈排序，相同调用栈的抽样排在一起再汇总
+            pages = (n * sizeof(Sample*) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+            samples = (Sample**)system_alloc(pages);
+            size_t k = 0;
+            for (size_t i = 0; i < TABLE_SIZE; ++i) {
+                for (Sample* it = table_[i]; it != nullptr; it = it->next) {
+                    samples[k++] = it;
+                }
+            }
+            std::sort(samples, samples + n, [](const Sample* a, const Sample* b) {
+                return std::lexicographical_compare(a->stack, a->stack + a->depth, b->stack, b->stack + b->depth);
+            });
+        }
+        size_t total_bytes = 0;
+        for (size_t i = 0; i < n; ++i) {
+            total_bytes += samples[i]->size;
+        }
+        // heap_v2 格式中记录的是抽样前的原始数据，pprof 会根据抽样间隔自己换算出估计值
+        // 这里只有活着的对象，累计申请的部分和活着的部分写成一样
+        int len = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                           n, total_bytes, n, total_bytes, sample_bytes_.load());
+        ok = write_all(fd, line, len);
+        for (size_t i = 0; i < n && ok;) {
+            size_t j = i;
+            size_t bytes = 0;
+            while (j < n && samples[j]->depth == samples[i]->depth &&
+                   std::equal(samples[i]->stack, samples[i]->stack + samples[i]->depth, samples[j]->stack)) {
+                bytes += samples[j]->size;
+                ++j;
+            }
+            len = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @", j - i, bytes, j - i, bytes);
+            for (size_t d = 0; d < samples[i]->depth; ++d) {
+                len += snprintf(line + len, sizeof(line) - len, " %p", samples[i]->stack[d]);
+            }
+            line[len++] = '\n';
+            ok = write_all(fd, line, len);
+            i = j;
+        }
+        if (samples != nullptr) {
+            system_free(samples, pages << PAGE_SHIFT);
+        }
+    }
+    // pprof 需要映射表把地址还原成符号
+    ok = ok && write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        ssize_t n;
+        while (ok && (n = read(maps, line, sizeof(line))) > 0) {
+            ok = write_all(fd, line, n);
+        }
+        close(maps);
+    }
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Common.h"
+#include "ObjectPool.h"
+#include <atomic>
+
+// 抽样的堆分析器，用来找出线上是哪些调用点占着内存
+// 和 tcmalloc 一样按字节数做几何分布的抽样: 平均每申请 sample_bytes 字节抽一次，大对象被抽中的概率更高
+// 抽中的申请记录调用栈，存到以地址为键的表里，释放时删除，任何时刻都可以导出还活着的抽样，格式兼容 pprof
+// 每个线程有一个倒数的字节计数器，快速路径上只有一次减法和一次判断；计数器减到负数才进入 should_sample，
+// 没有开启抽样时只是重置计数器，每隔 RECHECK_BYTES 字节检查一次开关
+// 和 tcmalloc 一样在申请之前决定是否抽样，抽中的对象不和普通对象共用 Span:
+// 不超过 MAX_BYTES 的对象放在分析器单独保留的一段地址空间里，每个独占一个槽位，释放时比较一次地址范围就能认出来，
+// 普通对象的释放（包括带 size 的释放）不需要查找 Span，也碰不到分析器的锁；大对象本来就独占一个 Span，在 Span 上做标记
+
+// 距离下一次抽样还剩多少字节，减到负数时抽样
+extern __thread long tls_bytes_until_sample __attribute__((tls_model("initial-exec")));
+
+class HeapProfiler {
+public:
+    static HeapProfiler* get_instance() {
+        return &inst_;
+    }
+    // 开始抽样，平均每 sample_bytes 字节抽一次
+    void start(size_t sample_bytes);
+    void stop();
+    // 计数器减到负数时在申请之前调用，重置计数器，返回这次申请是否要被抽样
+    bool should_sample();
+    // 抽中的不超过 MAX_BYTES 的对象: 在抽样区域里分一个槽位并记录，区域用完（或者没能保留）时返回 nullptr，这次不抽样
+    void* allocate_small(size_t size);
+    // 释放抽样区域里的对象，删除对应的记录
+    void free_small(void* ptr);
+    // 抽样区域里的对象申请时的大小
+    size_t small_size(void* ptr);
+    // 抽中的大对象照常申请以后调用，记录这次申请，并在它独占的 Span 上做标记
+    void record_large(void* ptr, size_t size, Span* span);
+    // 释放或者搬走有标记的大对象时调用，删除对应的记录
+    void drop(void* ptr, Span* span);
+    // 大对象原地调整大小时由 concurrent_reallocate 调用，更新记录的大小
+    void resize(void* ptr, size_t size);
+    // ptr 是否在抽样区域里，释放路径上只读两个全局变量
+    static bool is_sampled(void* ptr) {
+        size_t bytes = __atomic_load_n(&region_bytes_, __ATOMIC_ACQUIRE);
+        return (uintptr_t)ptr - __atomic_load_n(&region_begin_, __ATOMIC_RELAXED) < bytes;
+    }
+    // 把还活着的抽样按调用栈汇总，以 pprof 的 heap_v2 文本格式写到 path，失败返回 false
+    bool dump(const char* path);
+    // fork 前后加锁、解锁，保证子进程中抽样和释放时这把锁是可用的
+    void lock() {
+        mtx_.lock();
+    }
+    void unlock() {
+        mtx_.unlock();
+    }
+private:
+    static const size_t MAX_DEPTH = 32; // 最多记录多少层调用栈
+    static const size_t TABLE_SIZE = 1 << 14; // 哈希表的桶数
+    static const long RECHECK_BYTES = 16 * 1024 * 1024; // 没有开启抽样时，每隔这么多字节检查一次开关
+    static const size_t SLOT_BYTES = MAX_BYTES; // 抽样区域中每个槽位的大小，放得下任何一个小对象
+    static const size_t REGION_BYTES = (size_t)1 << 36; // 抽样区域最多保留这么多地址空间，失败时减半重试
+
+    struct Sample {
+        void* ptr;
+        size_t size;
+        size_t depth;
+        void* stack[MAX_DEPTH];
+        Sample* next;
+    };
+
+    HeapProfiler() = default;
+    HeapProfiler(const HeapProfiler&) = delete;
+    HeapProfiler& operator=(const HeapProfiler&) = delete;
+    // 下一次抽样的间隔，服从均值为 sample_bytes_ 的指数分布
+    long next_interval();
+    static size_t hash(void* ptr) {
+        return ((size_t)ptr >> 4) & (TABLE_SIZE - 1);
+    }
+    // 第一次开启时保留抽样区域，调用方持有 mtx_
+    void reserve_region();
+    // 把一条抽样记录插入表中，调用方持有 mtx_
+    void insert(void* ptr, size_t size, void* const* stack, int depth);
+    // 从表中取下 ptr 的记录，调用方持有 mtx_
+    Sample* remove(void* ptr);
+
+    static HeapProfiler inst_;
+    // 抽样区域的地址范围，只在第一次开启时写一次
+    static uintptr_t region_begin_;
+    static size_t region_bytes_;
+    std::atomic<bool> enabled_{false};
+    std::atomic<size_t> sample_bytes_{0};
+    std::atomic<size_t> live_samples_{0};
+    // 下面的成员由 mtx_ 保护
+    std::mutex mtx_;
+    Sample** table_ = nullptr; // 地址到抽样记录的哈希表，第一次开启时通过 system_alloc 申请，不能走 malloc
+    ObjectPool<Sample> sample_pool_;
+    unsigned int* free_slots_ = nullptr; // 释放以后可以重新使用的槽位编号，和 table_ 一样通过 system_alloc 申请
+    size_t free_slot_count_ = 0;
+    size_t next_slot_ = 0; // 从来没有用过的最小槽位编号
+};
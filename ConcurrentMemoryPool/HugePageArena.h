@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Common.h"
+
+// 大页（2MB）对齐的内存区，编译时定义 CMPOOL_HUGE_PAGES 后 PageCache 补充 128 页的 Span 时从这里切
+// system_alloc 每次 mmap 512KB 并且按 4KB 映射，堆很大时会分散成成千上万个小映射，TLB 不命中很多
+// 这里每次向系统要一整块 2MB 对齐的区域，优先使用预留的 HugeTLB 大页（MAP_HUGETLB），
+// 没有预留大页时退回普通映射并通过 MADV_HUGEPAGE 让内核用透明大页（THP）来映射
+// 区域按地址顺序切给 PageCache，相邻申请的 Span 落在同一个大页上，CentralCache 里正在使用的小对象集中在少数几个大页里
+// 每个 PageHeap 分片一个，只在持有分片的锁时调用
+class HugePageArena {
+public:
+    static const size_t HUGE_PAGE_SHIFT = 21; // 2MB
+    static const size_t HUGE_PAGE_SIZE = (size_t)1 << HUGE_PAGE_SHIFT;
+    static const size_t REGION_HUGE_PAGES = 4; // 每次向系统申请的大页个数
+
+    // 申请 kpage 页，kpage 不能超过一个区域的大小
+    void* alloc(size_t kpage) {
+        size_t bytes = kpage << PAGE_SHIFT;
+        assert(bytes <= REGION_HUGE_PAGES * HUGE_PAGE_SIZE);
+        if (cur_ + bytes > end_) {
+            // 区域大小是 128 页的整数倍，PageCache 每次都申请 128 页，不会剩下用不完的尾巴
+            new_region();
+        }
+        void* ptr = cur_;
+        cur_ += bytes;
+        return ptr;
+    }
+private:
+    void new_region() {
+        size_t bytes = REGION_HUGE_PAGES * HUGE_PAGE_SIZE;
+        void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        // HugeTLB 映射的地址天然按大页对齐，系统没有预留大页时 mmap 直接失败
+        ptr = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+        if (ptr == MAP_FAILED) {
+            // 多映射一个大页，再把首尾不对齐的部分还回去，得到 2MB 对齐的区域
+            char* raw = (char*)system_alloc((bytes + HUGE_PAGE_SIZE) >> PAGE_SHIFT);
+            char* aligned = (char*)SizeClassRule::round_up_((size_t)raw, HUGE_PAGE_SIZE);
+            if (aligned > raw) {
+                system_free(raw, aligned - raw);
+            }
+            system_free(aligned + bytes, raw + HUGE_PAGE_SIZE - aligned);
+            ptr = aligned;
+#ifdef MADV_HUGEPAGE
+            // THP 设置为 madvise 模式时必须显式申请，设置为 always 时也无害
+            madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+        }
+        cur_ = (char*)ptr;
+        end_ = cur_ + bytes;
+    }
+
+    char* cur_ = nullptr; // 当前区域中下一次切分的位置
+    char* end_ = nullptr; // 当前区域的结束位置
+};
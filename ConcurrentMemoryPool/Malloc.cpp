@@ -0,0 +1,362 @@
+// 用内存池替换 malloc/free 以及全局的 operator new/delete，编译成动态库后，已有的程序不需要重新编译，
+// 通过 LD_PRELOAD 加载即可切换到内存池:
+//   g++ -std=c++17 -O2 -fPIC -shared -pthread CentralCache.cpp PageCache.cpp ThreadCache.cpp CpuCache.cpp Scavenger.cpp Stats.cpp HeapProfiler.cpp Numa.cpp ConcurrentObjectPool.cpp Malloc.cpp -o libcmpool.so
+//   LD_PRELOAD=./libcmpool.so ./a.out
+// 环境变量:
+//   CMPOOL_RELEASE_AGE_MS        设置后启动后台回收线程，空闲超过这么多毫秒的页还给操作系统
+//   CMPOOL_SCAVENGE_INTERVAL_MS  后台回收线程的检查间隔，默认 1000 毫秒
+//   CMPOOL_HEAP_SAMPLE_BYTES     设置后开启堆分析器，平均每申请这么多字节抽样一次
+//   CMPOOL_HEAP_PROFILE          进程退出时把堆分析器的结果写到这个文件
+//   CMPOOL_THREAD_CACHE_BYTES    所有线程缓存一共可以占用的字节数，默认 32MB
+//   CMPOOL_NUMA_FAKE_NODES       在单节点的机器上模拟这么多个 NUMA 节点，用于测试
+
+#include "ConcurrentAllocate.h"
+#include "CentralCache.h"
+#include "ConcurrentObjectPool.h"
+#include <new>
+#include <cerrno>
+#include <malloc.h>
+#include <pthread.h>
+#include <cstdlib>
+
+// 超过这个大小的申请直接失败，防止对齐时溢出
+static const size_t MAX_REQUEST = (size_t)1 << 46;
+// glibc 的 malloc 保证返回的地址按 16 字节对齐
+static const size_t MALLOC_ALIGNMENT = 16;
+static const size_t PAGE_SIZE = (size_t)1 << PAGE_SHIFT;
+
+// fork 时保证子进程中内存池的锁都是可用的
+// 加锁的顺序: 对象池、堆分析器，然后是 ThreadCache、CentralCache、PageCache，和平时嵌套加锁的顺序一致
+static void fork_prepare() {
+    ConcurrentObjectPoolBase::lock_all();
+    HeapProfiler::get_instance()->lock();
+    ThreadCache::lock_pool();
+    for (size_t i = 0; i < NUMA_MAX_NODES; ++i) {
+        CentralCache::get_instance(i)->lock_all();
+    }
+    PageCache::get_instance()->lock_all();
+}
+
+static void fork_parent() {
+    PageCache::get_instance()->unlock_all();
+    for (size_t i = NUMA_MAX_NODES; i > 0; --i) {
+        CentralCache::get_instance(i - 1)->unlock_all();
+    }
+    ThreadCache::unlock_pool();
+    HeapProfiler::get_instance()->unlock();
+    ConcurrentObjectPoolBase::unlock_all();
+}
+
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static bool fork_registered = false; // 注册完以后申请时只读这个标记，不再调用 pthread_once
+
+static void register_fork_handlers() {
+    // 子进程中只有 fork 的那个线程，直接解锁即可
+    pthread_atfork(fork_prepare, fork_parent, fork_parent);
+    __atomic_store_n(&fork_registered, true, __ATOMIC_RELEASE);
+}
+
+// 第一次申请时注册 fork 的处理函数，动态库的构造函数可能晚于别的库里的第一次 malloc
+static inline void ensure_fork_handlers() {
+    if (__builtin_expect(!__atomic_load_n(&fork_registered, __ATOMIC_ACQUIRE), 0)) {
+        pthread_once(&fork_once, register_fork_handlers);
+    }
+}
+
+// 实际交给内存池的大小
+// 大于 8 字节的申请按 16 字节对齐，这样选出来的桶的对象大小都是 16 的倍数，Span 起始地址按页对齐，对象地址也就按 16 字节对齐
+static inline size_t malloc_size(size_t size) {
+    if (size == 0) {
+        return 1;
+    } else if (size > 8) {
+        return SizeClassRule::round_up_(size, MALLOC_ALIGNMENT);
+    }
+    return size;
+}
+
+// 动态库加载时读取环境变量
+__attribute__((constructor)) static void cmpool_init() {
+    const char* budget = getenv("CMPOOL_THREAD_CACHE_BYTES");
+    if (budget != nullptr) {
+        cmpool_set_thread_cache_budget(strtoul(budget, nullptr, 10));
+    }
+    const char* nodes = getenv("CMPOOL_NUMA_FAKE_NODES");
+    if (nodes != nullptr) {
+        cmpool_numa_fake_topology(strtoul(nodes, nullptr, 10));
+    }
+    const char* age = getenv("CMPOOL_RELEASE_AGE_MS");
+    if (age != nullptr) {
+        const char* interval = getenv("CMPOOL_SCAVENGE_INTERVAL_MS");
+        cmpool_start_scavenger(strtoul(age, nullptr, 10), interval ? strtoul(interval, nullptr, 10) : 1000);
+    }
+    const char* sample = getenv("CMPOOL_HEAP_SAMPLE_BYTES");
+    if (sample != nullptr) {
+        cmpool_heap_profiler_start(strtoul(sample, nullptr, 10));
+    }
+}
+
+__attribute__((destructor)) static void cmpool_fini() {
+    const char* path = getenv("CMPOOL_HEAP_PROFILE");
+    if (path != nullptr) {
+        cmpool_dump_heap_profile(path);
+    }
+}
+
+static void* cmpool_malloc(size_t size) {
+    ensure_fork_handlers();
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        return concurrent_allocate(malloc_size(size));
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+static void* cmpool_memalign(size_t align, size_t size) {
+    ensure_fork_handlers();
+    if (size > MAX_REQUEST || align > MAX_REQUEST) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        // 按 malloc 的规则换算大小以后再对齐，带 size 的 delete 按同样的规则换算
+        return concurrent_allocate_aligned(malloc_size(size), std::max(align, MALLOC_ALIGNMENT));
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+static size_t cmpool_usable_size(void* ptr) {
+    // 抽样的小对象不在任何 Span 上，可用的大小和同一个桶的普通对象一样
+    if (HeapProfiler::is_sampled(ptr)) {
+        return SizeClass::round_up(HeapProfiler::get_instance()->small_size(ptr));
+    }
+    Span* span = PageCache::get_instance()->map_obj_to_span(ptr);
+    if (!span->is_direct_) {
+        return span->object_size_;
+    }
+    // 按页申请的内存返回给用户的一定是 Span 的起始地址
+    return span->n_ << PAGE_SHIFT;
+}
+
+static bool is_power_of_two(size_t n) {
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+extern "C" {
+
+void* malloc(size_t size) noexcept {
+    return cmpool_malloc(size);
+}
+
+void free(void* ptr) noexcept {
+    if (ptr != nullptr) {
+        concurrent_free(ptr);
+    }
+}
+
+void* calloc(size_t n, size_t size) noexcept {
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    // 内存池中回收再利用的内存不是 0，需要清零
+    void* ptr = cmpool_malloc(total);
+    if (ptr != nullptr) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    if (ptr == nullptr) {
+        return cmpool_malloc(size);
+    }
+    if (size == 0) {
+        concurrent_free(ptr);
+        return nullptr;
+    }
+    size_t old_size = cmpool_usable_size(ptr);
+    // 原来的空间够用，并且不会浪费一半以上，就不搬家
+    if (size <= old_size && size >= old_size / 2) {
+        return ptr;
+    }
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    // 同一个桶、大对象原地伸缩或者 mremap 的情况都不需要拷贝
+    try {
+        return concurrent_reallocate(ptr, malloc_size(size));
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size) noexcept {
+    if (!is_power_of_two(align) || align % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    void* ptr = cmpool_memalign(align, size);
+    if (ptr == nullptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) noexcept {
+    if (!is_power_of_two(align)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return cmpool_memalign(align, size);
+}
+
+void* memalign(size_t align, size_t size) noexcept {
+    if (!is_power_of_two(align)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return cmpool_memalign(align, size);
+}
+
+void* valloc(size_t size) noexcept {
+    return cmpool_memalign(PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) noexcept {
+    return cmpool_memalign(PAGE_SIZE, SizeClassRule::round_up_(size, PAGE_SIZE));
+}
+
+size_t malloc_usable_size(void* ptr) noexcept {
+    return ptr == nullptr ? 0 : cmpool_usable_size(ptr);
+}
+
+} // extern "C"
+
+// 全局 operator new/delete，失败时按标准的要求调用 new_handler，没有 new_handler 再抛异常
+
+static void* cmpool_new(size_t size) {
+    void* ptr;
+    while ((ptr = cmpool_malloc(size)) == nullptr) {
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return ptr;
+}
+
+static void* cmpool_new_aligned(size_t size, std::align_val_t align) {
+    void* ptr;
+    while ((ptr = cmpool_memalign((size_t)align, size)) == nullptr) {
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size) {
+    return cmpool_new(size);
+}
+
+void* operator new[](size_t size) {
+    return cmpool_new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return cmpool_malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return cmpool_malloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    return cmpool_new_aligned(size, align);
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    return cmpool_new_aligned(size, align);
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return cmpool_memalign((size_t)align, size);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return cmpool_memalign((size_t)align, size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+// 带 size 的 delete 不需要查找 Span，size 要按申请时同样的规则换算
+static inline void cmpool_delete_sized(void* ptr, size_t size) {
+    if (ptr != nullptr) {
+        concurrent_free_sized(ptr, malloc_size(size));
+    }
+}
+
+static inline void cmpool_delete_sized_aligned(void* ptr, size_t size, std::align_val_t align) {
+    if (ptr != nullptr) {
+        concurrent_free_aligned(ptr, malloc_size(size), std::max((size_t)align, MALLOC_ALIGNMENT));
+    }
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+    cmpool_delete_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+    cmpool_delete_sized(ptr, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t align) noexcept {
+    cmpool_delete_sized_aligned(ptr, size, align);
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t align) noexcept {
+    cmpool_delete_sized_aligned(ptr, size, align);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
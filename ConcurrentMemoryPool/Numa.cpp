@@ -0,0 +1,75 @@
+#include "Numa.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+NumaTopology NumaTopology::inst_;
+
+// 测试时指定的节点，-1 表示按当前 CPU 判断
+static __thread int tls_node __attribute__((tls_model("initial-exec"))) = -1;
+
+size_t NumaTopology::detect() {
+    // 文件内容形如 "0" 或者 "0-1"，取最后一个数字加一，不能用 stdio（会申请内存）
+    size_t n = 1;
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd >= 0) {
+        char buf[64];
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        size_t last = 0;
+        for (ssize_t i = 0; i < len; ++i) {
+            if (buf[i] >= '0' && buf[i] <= '9') {
+                last = last * 10 + (buf[i] - '0');
+            } else {
+                n = std::max(n, last + 1);
+                last = 0;
+            }
+        }
+        n = std::max(n, last + 1);
+    }
+    n = std::min(n, NUMA_MAX_NODES);
+    size_t expected = 0;
+    // 已经被 fake 设置过就用设置的值
+    if (!nodes_.compare_exchange_strong(expected, n, std::memory_order_relaxed)) {
+        return expected;
+    }
+    return n;
+}
+
+size_t NumaTopology::current_node() {
+    size_t n = nodes();
+    if (tls_node >= 0) {
+        return tls_node % n;
+    }
+    if (n == 1) {
+        return 0;
+    }
+    // glibc 的 getcpu 走 vDSO，不陷入内核
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if (getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+    return (fake_.load(std::memory_order_relaxed) ? cpu : node) % n;
+}
+
+void NumaTopology::bind(void* ptr, size_t bytes, size_t node) {
+    if (nodes() == 1 || fake_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    // 不依赖 libnuma，直接调用 mbind，失败时（比如内核不支持）照常使用
+    const int MPOL_PREFERRED = 1;
+    unsigned long mask = 1ul << node;
+    syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+void NumaTopology::fake(size_t nodes) {
+    fake_ = true;
+    nodes_ = std::max<size_t>(1, std::min(nodes, NUMA_MAX_NODES));
+}
+
+void NumaTopology::set_thread_node(int node) {
+    tls_node = node;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+
+// NUMA 拓扑，每个节点有自己的 CentralCache 和一组 PageHeap 分片
+// 线程每次找 CentralCache、PageCache 要内存时，通过 getcpu 得到当前所在的节点，只从这个节点的缓存和分片中取
+// 分片向操作系统申请的内存用 mbind(MPOL_PREFERRED) 绑定到分片所属的节点，第一次访问时由这个节点分配物理页
+// 释放时对象回到它所在 Span 所属节点的 CentralCache，Span 回到它所在页所属的分片
+// 单节点的机器上可以用 fake 模拟多个节点（CPU 按编号轮流分到各个节点），
+// 也可以用 set_thread_node 指定某个线程所在的节点，这两种情况下不调用 mbind
+
+// 最多支持的节点个数，超过的节点按取模合并
+static const size_t NUMA_MAX_NODES = 4;
+
+class NumaTopology {
+public:
+    static NumaTopology* get_instance() {
+        return &inst_;
+    }
+    // 节点个数，第一次调用时读取 /sys/devices/system/node/online
+    size_t nodes() {
+        size_t n = nodes_.load(std::memory_order_relaxed);
+        return n != 0 ? n : detect();
+    }
+    // 当前线程所在的节点
+    size_t current_node();
+    // 把 [ptr, ptr + bytes) 的物理页优先分配在 node 上，只有真实的多节点机器才生效
+    void bind(void* ptr, size_t bytes, size_t node);
+    // 模拟 nodes 个节点，CPU i 属于节点 i % nodes，需要在第一次申请内存之前调用
+    void fake(size_t nodes);
+    // 指定当前线程所在的节点，传 -1 恢复按 CPU 判断，用于测试
+    static void set_thread_node(int node);
+private:
+    NumaTopology() = default;
+    NumaTopology(const NumaTopology&) = delete;
+    NumaTopology& operator=(const NumaTopology&) = delete;
+    size_t detect();
+
+    static NumaTopology inst_;
+    std::atomic<size_t> nodes_{0}; // 0 表示还没有读取
+    std::atomic<bool> fake_{false};
+};
@@ -1,35 +1,57 @@
+#pragma once
+
 #include <iostream>
 #include <cstring>
 #include "Common.h"
 
-template<class T>
+// 对象池的统计，通过 ObjectPool::stats() 获取
+struct ObjectPoolStats {
+    size_t chunks = 0; // 大块内存的个数
+    size_t chunk_bytes = 0; // 所有大块内存一共占用的虚拟地址字节数
+    size_t released_chunks = 0; // 空闲并且物理内存已经还给操作系统的大块内存个数
+    size_t resident_bytes = 0; // 物理内存还在的字节数（还回去的大块只剩头部所在的一页）
+    size_t live_objects = 0; // 正在使用的对象个数
+    size_t free_objects = 0; // 切出来过、又还回来的对象个数
+};
+
+// 定长对象池，不加锁，需要在线程之间共享时由调用方加锁，或者使用 ConcurrentObjectPool
+// 内存按 CHUNK_BYTES 对齐的大块申请，对象的地址向下对齐就能找到所在的大块，每个大块记录自己的自由链表和正在使用的对象个数
+// 1. 申请时优先用还有对象在用的大块，尽量让其他大块空出来
+// 2. 大块里的对象全部还回来以后，保留 KEEP_EMPTY_CHUNKS 个备用，其余的用 madvise 把物理内存还给操作系统
+//    虚拟地址不释放，已经释放的对象（比如基数树里残留的 Span*）被读到时只会读到 0，不会访问到已经 munmap 的地址
+// 3. shrink() 把空闲的大块整个 munmap 掉，调用方需要保证没有人再访问已经释放的对象
+// RELEASE_EMPTY_CHUNKS 为 false 时空闲的大块一直保留，已经释放的对象还能读到原来的内容
+// （tcPool: 远程释放时别的线程可能还会访问已经销毁的 ThreadCache，要读到 REMOTE_CLOSED 而不是 0）
+template<class T, bool RELEASE_EMPTY_CHUNKS = true>
 class ObjectPool {
 public:
+    ObjectPool() = default;
+    // 哨兵指向自己，不能拷贝
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
     T* New() {
+        Chunk* chunk = partial_.next_;
+        if (chunk == nullptr || chunk == &partial_) {
+            chunk = take_empty();
+        }
         T* obj = nullptr;
         // 优先把还回来内存块对象，再次重复利用
-        if (free_list_) {
+        if (chunk->free_list_) {
             // 从自由链表头删一个对象
-            void* next = next_obj(free_list_);
-            obj = (T*)free_list_;
-            free_list_ = next;
+            obj = (T*)chunk->free_list_;
+            chunk->free_list_ = next_obj(obj);
+            --free_objects_;
         } else {
-            // 剩余内存不够一个对象大小时，则重新开大块空间
-            if (remain_bytes_ < sizeof(T)) {
-                remain_bytes_ = 128 * 1024;
-                memory_ = (char*)system_alloc(remain_bytes_ >> PAGE_SHIFT);
-                // 申请内存失败抛异常
-                if (memory_ == nullptr) {
-                    throw std::bad_alloc();
-                }
-            }
-            // 从大块内存中切出 obj_size 字节的内存
-            obj = (T*)memory_;
-            // 如果对象的大小小于指针的大小，那么我们也要每次给对象分配最低指针的大小。因为 FreeList 必须能存得下一个指针的大小
-            size_t obj_size = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
-            // 调整成员变量
-            memory_ += obj_size;
-            remain_bytes_ -= obj_size;
+            // 大块内存剩下的部分（包括以前切剩下的尾巴）按顺序切
+            obj = (T*)chunk->unused_;
+            chunk->unused_ += OBJ_SIZE;
+        }
+        ++chunk->live_;
+        ++live_objects_;
+        // 大块切完了，从 partial_ 中移走，等有对象还回来时再放回去
+        if (chunk->free_list_ == nullptr && chunk->unused_ + OBJ_SIZE > (char*)chunk + CHUNK_BYTES) {
+            unlink(chunk);
         }
         // 定位 new，显示调用 T 的构造函数初始化
         new(obj)T;
@@ -38,13 +60,178 @@ public:
     void Delete(T* obj) {
         // 显示调用析构函数清理对象
         obj->~T();
+        Chunk* chunk = chunk_of(obj);
+        bool was_full = chunk->free_list_ == nullptr && chunk->unused_ + OBJ_SIZE > (char*)chunk + CHUNK_BYTES;
         // 头插
-        next_obj(obj) = free_list_;
-        free_list_ = obj;
+        next_obj(obj) = chunk->free_list_;
+        chunk->free_list_ = obj;
+        ++free_objects_;
+        --live_objects_;
+        if (--chunk->live_ == 0) {
+            if (!was_full) {
+                unlink(chunk);
+            }
+            put_empty(chunk);
+        } else if (was_full) {
+            link_front(&partial_, chunk);
+        }
+    }
+    // 把所有空闲的大块 munmap 掉，返回还给操作系统的字节数
+    size_t shrink() {
+        size_t bytes = 0;
+        while (empty_.next_ != &empty_) {
+            Chunk* chunk = empty_.next_;
+            unlink(chunk);
+            free_objects_ -= chunk_free_objects(chunk);
+            if (chunk->released_) {
+                --released_chunks_;
+            }
+            --chunks_;
+            bytes += CHUNK_BYTES;
+            system_free(chunk, CHUNK_BYTES);
+        }
+        resident_empty_ = 0;
+        return bytes;
+    }
+    ObjectPoolStats stats() const {
+        ObjectPoolStats stats;
+        stats.chunks = chunks_;
+        stats.chunk_bytes = chunks_ * CHUNK_BYTES;
+        stats.released_chunks = released_chunks_;
+        stats.resident_bytes = (chunks_ - released_chunks_) * CHUNK_BYTES + (released_chunks_ << PAGE_SHIFT);
+        stats.live_objects = live_objects_;
+        stats.free_objects = free_objects_;
+        return stats;
     }
 
 private:
-    char* memory_ = nullptr; // 指向大块内存的指针
-    size_t remain_bytes_ = 0; // 大块内存在切分过程中剩余字节数
-    void* free_list_ = nullptr; // 还回来过程中链接的自由链表的头指针
-};
\ No newline at end of file
+    // 大块内存的头部，放在每个大块的最前面
+    struct Chunk {
+        Chunk* prev_;
+        Chunk* next_;
+        void* free_list_; // 还回来的对象
+        char* unused_; // 还没有切过的部分的起始地址
+        size_t live_; // 正在使用的对象个数
+        bool released_; // 空闲时物理内存已经还给操作系统
+    };
+    // 如果对象的大小小于指针的大小，那么我们也要每次给对象分配最低指针的大小。因为 FreeList 必须能存得下一个指针的大小
+    static constexpr size_t OBJ_SIZE = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
+    // 第一个对象的偏移，按对象的对齐要求对齐
+    static constexpr size_t FIRST_OFFSET = (sizeof(Chunk) + alignof(T) - 1) & ~(alignof(T) - 1);
+    // 至少 128KB，放不下一个对象时取能放下的最小的 2 的幂
+    static constexpr size_t chunk_bytes() {
+        size_t bytes = 128 * 1024;
+        while (bytes < FIRST_OFFSET + OBJ_SIZE) {
+            bytes <<= 1;
+        }
+        return bytes;
+    }
+    static constexpr size_t CHUNK_BYTES = chunk_bytes();
+    // 空闲下来以后不还给操作系统的大块个数，避免对象个数在大块边界上来回波动时反复 madvise
+    static const size_t KEEP_EMPTY_CHUNKS = 1;
+
+    static Chunk* chunk_of(void* obj) {
+        return (Chunk*)((size_t)obj & ~(CHUNK_BYTES - 1));
+    }
+
+    size_t chunk_free_objects(Chunk* chunk) const {
+        size_t n = 0;
+        for (void* obj = chunk->free_list_; obj != nullptr; obj = next_obj(obj)) {
+            ++n;
+        }
+        return n;
+    }
+
+    static void unlink(Chunk* chunk) {
+        chunk->prev_->next_ = chunk->next_;
+        chunk->next_->prev_ = chunk->prev_;
+    }
+
+    static void link_front(Chunk* head, Chunk* chunk) {
+        chunk->next_ = head->next_;
+        chunk->prev_ = head;
+        head->next_->prev_ = chunk;
+        head->next_ = chunk;
+    }
+
+    static void link_back(Chunk* head, Chunk* chunk) {
+        link_front(head->prev_, chunk);
+    }
+
+    // 空闲的大块: 物理内存还在的放在 empty_ 的前面，超过 KEEP_EMPTY_CHUNKS 个时还给操作系统放到后面
+    void put_empty(Chunk* chunk) {
+        if (!RELEASE_EMPTY_CHUNKS || resident_empty_ < KEEP_EMPTY_CHUNKS) {
+            ++resident_empty_;
+            link_front(&empty_, chunk);
+            return;
+        }
+        // 对象全部作废，从头开始切，头部所在的第一页保留
+        free_objects_ -= chunk_free_objects(chunk);
+        chunk->free_list_ = nullptr;
+        chunk->unused_ = (char*)chunk + FIRST_OFFSET;
+        chunk->released_ = system_release((char*)chunk + ((size_t)1 << PAGE_SHIFT), CHUNK_BYTES - ((size_t)1 << PAGE_SHIFT));
+        if (chunk->released_) {
+            ++released_chunks_;
+            link_back(&empty_, chunk);
+        } else {
+            // madvise 失败，物理内存还在，按常驻的大块放到前面，take_empty 取走时才能正确计数
+            ++resident_empty_;
+            link_front(&empty_, chunk);
+        }
+    }
+
+    // 取一个空闲的大块放到 partial_ 中，没有就向操作系统申请
+    Chunk* take_empty() {
+        if (partial_.next_ == nullptr) {
+            // 第一次使用，两个哨兵指向自己；放在这里是为了让全局的对象池能在编译期初始化
+            partial_.next_ = partial_.prev_ = &partial_;
+            empty_.next_ = empty_.prev_ = &empty_;
+        }
+        Chunk* chunk = empty_.next_;
+        if (chunk != &empty_) {
+            unlink(chunk);
+            if (chunk->released_) {
+                chunk->released_ = false;
+                --released_chunks_;
+            } else {
+                --resident_empty_;
+            }
+        } else {
+            chunk = alloc_chunk();
+        }
+        link_front(&partial_, chunk);
+        return chunk;
+    }
+
+    // 申请一个按 CHUNK_BYTES 对齐的大块: 多申请一个 CHUNK_BYTES，再把前后多出来的部分还回去
+    Chunk* alloc_chunk() {
+        char* ptr = (char*)system_alloc((2 * CHUNK_BYTES) >> PAGE_SHIFT);
+        // 申请内存失败抛异常
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        char* aligned = (char*)(((size_t)ptr + CHUNK_BYTES - 1) & ~(CHUNK_BYTES - 1));
+        if (aligned > ptr) {
+            system_free(ptr, aligned - ptr);
+        }
+        if (aligned + CHUNK_BYTES < ptr + 2 * CHUNK_BYTES) {
+            system_free(aligned + CHUNK_BYTES, ptr + 2 * CHUNK_BYTES - (aligned + CHUNK_BYTES));
+        }
+        Chunk* chunk = (Chunk*)aligned;
+        chunk->free_list_ = nullptr;
+        chunk->unused_ = aligned + FIRST_OFFSET;
+        chunk->live_ = 0;
+        chunk->released_ = false;
+        ++chunks_;
+        return chunk;
+    }
+
+    // 带头双向链表的哨兵，只用到 prev_ 和 next_
+    Chunk partial_ = {}; // 还有空间、并且有对象在使用的大块，头部的大块优先使用
+    Chunk empty_ = {}; // 对象全部还回来的大块
+    size_t resident_empty_ = 0; // empty_ 中物理内存还在的个数
+    size_t chunks_ = 0;
+    size_t released_chunks_ = 0;
+    size_t live_objects_ = 0;
+    size_t free_objects_ = 0;
+};
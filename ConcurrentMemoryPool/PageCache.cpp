@@ -1,118 +1,263 @@
 #include "PageCache.h"
+#include "Stats.h"
+
+#include <chrono>
 
 PageCache PageCache::inst_; // 静态成员类外定义
+PageMap3<48 - PAGE_SHIFT> PageHeap::id_span_map_;
 
-Span* PageCache::map_obj_to_span(void* obj) {
-    // 右移 12 位，找到对应的 id
-    PAGE_ID id = (PAGE_ID)obj >> PAGE_SHIFT;
-    auto ret = id_span_map_.find(id);
-    if (ret != id_span_map_.end()) {
-        return ret->second;
-    } else {
-        assert(false);
-        return nullptr;
+// 当前线程使用的分片编号加 1，0 表示还没有分配
+static __thread unsigned int tls_heap __attribute__((tls_model("initial-exec"))) = 0;
+
+static size_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 从 span 中切出 k 页时，这 k 页分到的已经还给操作系统的页数
+// 不记录具体是哪些页，部分还回去的 Span 按页数比例估算，只影响统计
+static inline size_t returned_share(Span* span, size_t k) {
+    if (span->returned_ == 0 || span->returned_ == span->n_) {
+        return span->returned_ == 0 ? 0 : k;
     }
+    return (size_t)((unsigned __int128)span->returned_ * k / span->n_);
+}
+
+// 大 Span 按页数分组，第 i 组为 [2^(i+7), 2^(i+8)) 页
+static inline size_t large_bin(size_t n) {
+    assert(n >= NPAGES);
+    return 63 - __builtin_clzll(n) - 7;
 }
 
-Span* PageCache::new_span(size_t k) {
-    // 加锁，防止多个线程同时到 PageCache 中申请 Span
-    // 这里必须是给全局加锁，不能单独的给每个桶加锁
-    // 如果对应桶没有 Span，是需要向系统申请的
-    // 可能存在多个线程同时向系统申请内存的可能
+unsigned char PageHeap::tag() const {
+    return (unsigned char)(this - PageCache::get_instance()->heaps_ + 1);
+}
+
+Span* PageHeap::new_span(size_t k, size_t align) {
     assert(k > 0);
+    Span* span = take_span(k, align);
+    if (span != nullptr) {
+        return span;
+    }
+    if (align > 1) {
+        // 操作系统只保证按页对齐，多申请 align - 1 页，里面一定有一段对齐的 k 页
+        // 前后多出来的页作为空闲 Span 留在分片里，之后的申请可以继续用
+        insert_free_span(system_span(std::max(k + align - 1, NPAGES - 1)));
+        return take_span(k, align);
+    }
     // 如果申请的页大于 128，直接去堆上申请
     if (k >= NPAGES) {
-        void* ptr = system_alloc(k);
-        Span* span = span_pool_.New();
-        span->page_id_ = (PAGE_ID)ptr >> PAGE_SHIFT;
-        span->n_ = k;
-        span->object_size_ = k << PAGE_SHIFT;
-        // 建立页号和 Span* 的映射
-        // 将申请的大块内存块的第一个页号插入进去就可以
-        // 因为申请的内存大于 MAX_BYTES，是直接还给 PageCache，不需要其他页到这个 Span 的映射
-        id_span_map_[span->page_id_] = span;
+        span = system_span(k);
+        mark_used(span);
         return span;
     }
-    // 先检查第 k 个桶里面有没有 Span
-    if (!span_list_[k].empty()) {
-        // 第 k 个桶里面有 Span 直接头切一个块
-        Span* k_span = span_list_[k].pop_front();
-        // 建立 id 和 Span 的映射，方便 CentralCache 回收小块内存时，查找对应的 Span
-        for (PAGE_ID i = 0; i < k_span->n_; ++i) {
-            id_span_map_[k_span->page_id_ + i] = k_span;
-        }
-        return k_span;
-    }
-    // 检查一下后面的桶里面有没有 Span，如果有可以把他它进行切分
-    for (size_t i = k + 1; i < NPAGES; i++) {
-        if (!span_list_[i].empty()) {
-            Span* n_span = span_list_[i].pop_front();
-            // new 一个 Span 用于存放其中一个切分好的 Span
-            Span* k_span = span_pool_.New();
-            // 在 n_span 的头部切一个 k 页下来，k 页 Span 返回
-            k_span->page_id_ = n_span->page_id_;
-            k_span->n_ = k;
-            n_span->page_id_ += k;
-            n_span->n_ -= k;
-            // n_span 再挂到对应映射的位置
-            span_list_[n_span->n_].push_front(n_span);
-            // 存储 n_span 的首尾页号跟 n_span 映射，方便 PageCahce 回收内存时进行的合并查找
-            id_span_map_[n_span->page_id_] = n_span;
-            id_span_map_[n_span->page_id_ + n_span->n_ - 1] = n_span;
-            // 建立 id 和 Span 的映射，方便 CentralCache 回收小块内存时，查找对应的 Span
-            for (PAGE_ID i = 0; i < k_span->n_; ++i) {
-                id_span_map_[k_span->page_id_ + i] = k_span;
-            }
-            k_span->is_used_ = true;
-            return k_span;
+    // 走到这个位置就说明后面没有大页的 Span 了
+    // 这时就去找堆要一个 128 页的 Span，挂到桶里之后再切分
+    insert_free_span(system_span(NPAGES - 1));
+    return take_span(k);
+}
+
+Span* PageHeap::take_span(size_t k, size_t align) {
+    assert(k > 0);
+    if (align > 1) {
+        return take_aligned_span(k, align);
+    }
+    Span* span = find_free_span(k);
+    if (span == nullptr) {
+        return nullptr;
+    }
+    Span* k_span = split_span(span, k);
+    mark_used(k_span);
+    return k_span;
+}
+
+Span* PageHeap::system_span(size_t k) {
+    void* ptr = nullptr;
+#ifdef CMPOOL_HUGE_PAGES
+    if (k == NPAGES - 1) {
+        ptr = huge_arena_.alloc(k);
+    } else {
+        ptr = system_alloc(k);
+    }
+#else
+    ptr = system_alloc(k);
+#endif
+    system_pages_ += k;
+    // 还没有访问过，物理页在第一次访问时分配在分片所属的节点上
+    NumaTopology::get_instance()->bind(ptr, k << PAGE_SHIFT, (tag() - 1) % NumaTopology::get_instance()->nodes());
+    Span* span = span_pool_.New();
+    span->page_id_ = (PAGE_ID)ptr >> PAGE_SHIFT;
+    span->n_ = k;
+    // 刚映射的内存按刚释放的算，不能让后台回收线程在第一轮就把它当作空闲已久的内存 madvise 掉
+    span->free_time_ = now_ms();
+    // 提前建立好这段内存所需要的基数树节点，之后 set 就不会再申请内存
+    id_span_map_.ensure(span->page_id_, span->n_);
+    // 这段内存从此属于这个分片
+    id_span_map_.set_tag(span->page_id_, span->n_, tag());
+    id_span_map_.set(span->page_id_, span);
+    id_span_map_.set(span->page_id_ + span->n_ - 1, span);
+    return span;
+}
+
+Span* PageHeap::split_span(Span* n_span, size_t k) {
+    assert(n_span->n_ >= k);
+    if (n_span->n_ == k) {
+        return n_span;
+    }
+    // new 一个 Span 用于存放其中一个切分好的 Span
+    Span* k_span = span_pool_.New();
+    // 在 n_span 的头部切一个 k 页下来，k 页 Span 返回
+    k_span->page_id_ = n_span->page_id_;
+    k_span->n_ = k;
+    k_span->returned_ = returned_share(n_span, k);
+    n_span->returned_ -= k_span->returned_;
+    n_span->page_id_ += k;
+    n_span->n_ -= k;
+    // 还回去的页数按两部分分开算，k_span 的部分在 mark_used 时扣掉
+    // n_span 再挂到对应映射的位置
+    insert_free_span(n_span);
+    // 存储 n_span 的首尾页号跟 n_span 映射，方便 PageCahce 回收内存时进行的合并查找
+    id_span_map_.set(n_span->page_id_, n_span);
+    id_span_map_.set(n_span->page_id_ + n_span->n_ - 1, n_span);
+    return k_span;
+}
+
+Span* PageHeap::find_free_span(size_t k) {
+    // 通过位图找到第一个不小于 k 的非空桶，第 k 个桶里面有 Span 直接拿，后面的桶里面有 Span 可以把它进行切分
+    // 都没有就从空闲的大 Span 中找最合适的
+    size_t i = k < NPAGES ? find_nonempty_bucket(k) : 0;
+    if (i != 0) {
+        ++spans_scanned_;
+        Span* span = span_list_[i].begin();
+        erase_free_span(span);
+        return span;
+    }
+    return find_large_span(k);
+}
+
+Span* PageHeap::find_large_span(size_t k) {
+    size_t bin = k >= NPAGES ? large_bin(k) : 0;
+    // 每组内部按页数从小到大排列，第一个够大的就是最合适的
+    for (Span* it = large_list_[bin].begin(); it != large_list_[bin].end(); it = it->next_) {
+        ++spans_scanned_;
+        if (it->n_ >= k) {
+            erase_free_span(it);
+            return it;
         }
     }
-    // 走到这个位置就说明后面没有大页的 Span 了
-    // 这时就去找堆要一个 128 页的 Span
-    Span* big_span = span_pool_.New();
-    void* ptr = system_alloc(NPAGES - 1);
-    big_span->page_id_ = (PAGE_ID)ptr >> PAGE_SHIFT;
-    big_span->n_ = NPAGES - 1;
-    span_list_[big_span->n_].push_front(big_span);
-    // 调用自己，下次将 128 页进行拆分
-    return new_span(k);
+    // 后面的组里面的 Span 都比 k 大，取第一个非空组里面最小的那个
+    unsigned int bins = large_bins_ & ~((2u << bin) - 1);
+    if (bins == 0) {
+        return nullptr;
+    }
+    ++spans_scanned_;
+    Span* span = large_list_[__builtin_ctz(bins)].begin();
+    erase_free_span(span);
+    return span;
 }
 
-void PageCache::releas_span_to_page(Span* span) {
-    // 该 Span 管理的空间是向堆申请的
-    if (span->n_ > NPAGES - 1) {
+// 起始页号按 align 对齐需要跳过的页数
+static inline size_t align_offset(Span* span, size_t align) {
+    return (align - (span->page_id_ & (align - 1))) & (align - 1);
+}
+
+Span* PageHeap::take_aligned_span(size_t k, size_t align) {
+    assert((align & (align - 1)) == 0);
+    // 不小于 k + align - 1 页的 Span 里一定有对齐的一段，只在这样的 Span 中找，和普通的申请一样通过位图和分组直接定位
+    // 不逐个检查更小的 Span 的起始页号: 对齐位置前面切剩下的页一直留在桶里，逐个检查时每次申请都要把它们全部看一遍
+    Span* span = find_free_span(k + align - 1);
+    if (span == nullptr) {
+        return nullptr;
+    }
+    // 对齐位置前面的页切下来挂回去
+    size_t offset = align_offset(span, align);
+    if (offset > 0) {
+        Span* head = span_pool_.New();
+        head->page_id_ = span->page_id_;
+        head->n_ = offset;
+        head->returned_ = returned_share(span, offset);
+        head->free_time_ = span->free_time_;
+        span->returned_ -= head->returned_;
+        span->page_id_ += offset;
+        span->n_ -= offset;
+        insert_free_span(head);
+        id_span_map_.set(head->page_id_, head);
+        id_span_map_.set(head->page_id_ + head->n_ - 1, head);
+    }
+    // 后面剩下的页由 split_span 挂回去
+    Span* k_span = split_span(span, k);
+    mark_used(k_span);
+    return k_span;
+}
+
+size_t PageHeap::find_nonempty_bucket(size_t k) const {
+    for (size_t w = k / 64; w < BUCKET_WORDS; ++w) {
+        unsigned long long bits = bucket_bits_[w];
+        // 第一个字里面去掉小于 k 的桶
+        if (w == k / 64) {
+            bits &= ~0ull << (k % 64);
+        }
+        if (bits != 0) {
+            return w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return 0;
+}
+
+void PageHeap::releas_span_to_page(Span* span) {
+    // 对 Span 前后的页，尝试进行合并，缓解内存碎片问题
+    merge_neighbors(span, false);
+    // 空闲的大 Span 太多时，直接还给系统
+    if (span->n_ >= NPAGES && large_free_pages_ + span->n_ > MAX_LARGE_FREE_PAGES) {
         void* ptr = (void*)(span->page_id_ << PAGE_SHIFT);
-        system_free(ptr, span->object_size_);
+        // 这段内存还给系统后可能被别的 mmap 复用，要把映射清掉，防止合并时找到已经释放的 Span
+        for (PAGE_ID i = 0; i < span->n_; ++i) {
+            id_span_map_.set(span->page_id_ + i, nullptr);
+        }
+        id_span_map_.set_tag(span->page_id_, span->n_, 0);
+        returned_pages_ -= span->returned_;
+        system_free(ptr, span->n_ << PAGE_SHIFT);
+        system_pages_ -= span->n_;
         span_pool_.Delete(span);
         return;
     }
+    // 将和并后的 Span 插入到 PageCache 对应的哈希桶中
+    span->is_used_ = false;
+    span->free_time_ = now_ms();
+    insert_free_span(span);
+    id_span_map_.set(span->page_id_, span);
+    id_span_map_.set(span->page_id_ + span->n_ - 1, span);
+}
 
-    // 对 Span 前后的页，尝试进行合并，缓解内存碎片问题
+void PageHeap::merge_neighbors(Span* span, bool returned_only) {
     // 向前合并
     while (1) {
         // 与 Span 链表相连的，上一个 Span 的页号
         PAGE_ID prev_id = span->page_id_ - 1;
-        auto ret = id_span_map_.find(prev_id);
+        // 相邻的页属于别的分片，它的 Span 由别的锁保护，不合并
+        if (id_span_map_.get_tag(prev_id) != tag()) {
+            break;
+        }
+        Span* prev_span = id_span_map_.get(prev_id);
         // 前面的页号没有，不合并
         // 前面的 Span 没有被申请过（如果在映射表当中，就证明被申请过）
-        if (ret == id_span_map_.end()) {
+        if (prev_span == nullptr) {
             break;
         }
         // 前面相邻页的 Span 在使用，不合并
         // 这里不能使用 prev_span 的 use_count 作为判断依据，因为 use_count 的值的变化存在间隙（在切分 Span 时）
-        Span* prev_span = ret->second;
         if (prev_span->is_used_ == true) {
             break;
         }
-        // 合并出超过 128 页的 Span 没办法管理，不合并
-        if (prev_span->n_ + span->n_ > NPAGES - 1) {
+        if (!can_merge(span, prev_span, returned_only)) {
             break;
         }
 
         span->page_id_ = prev_span->page_id_;
         span->n_ += prev_span->n_;
+        span->returned_ += prev_span->returned_;
 
-        span_list_[prev_span->n_].erase(prev_span);
+        erase_free_span(prev_span);
         span_pool_.Delete(prev_span);
         prev_span = nullptr;
     }
@@ -120,27 +265,396 @@ void PageCache::releas_span_to_page(Span* span) {
     // 向后合并
     while (1) {
         PAGE_ID next_id = span->page_id_ + span->n_;
-        auto ret = id_span_map_.find(next_id);
-        if (ret == id_span_map_.end()) {
+        if (id_span_map_.get_tag(next_id) != tag()) {
+            break;
+        }
+        Span* next_span = id_span_map_.get(next_id);
+        if (next_span == nullptr) {
             break;
         }
-        Span* next_span = ret->second;
         if (next_span->is_used_ == true) {
             break;
         }
-        if (next_span->n_ + span->n_ > NPAGES - 1) {
+        if (!can_merge(span, next_span, returned_only)) {
             break;
         }
 
         span->n_ += next_span->n_;
+        span->returned_ += next_span->returned_;
 
-        span_list_[next_span->n_].erase(next_span);
+        erase_free_span(next_span);
         span_pool_.Delete(next_span);
         next_span = nullptr;
     }
-    // 将和并后的 Span 插入到 PageCache 对应的哈希桶中
-    span->is_used_ = false;
-    span_list_[span->n_].push_front(span);
-    id_span_map_[span->page_id_] = span;
-    id_span_map_[span->page_id_ + span->n_ - 1] = span;
-}
\ No newline at end of file
+}
+
+bool PageHeap::resize_span(Span* span, size_t k) {
+    assert(span->is_used_ && k > 0);
+    if (k < span->n_) {
+        // 尾部的页当作一个刚释放的 Span，和后面空闲的 Span 合并
+        // 前面紧挨着的是还在使用的 span，不会被合并
+        Span* tail = span_pool_.New();
+        tail->page_id_ = span->page_id_ + k;
+        tail->n_ = span->n_ - k;
+        tail->is_used_ = true;
+        span->n_ = k;
+        releas_span_to_page(tail);
+        return true;
+    }
+    // 先确认后面相邻的空闲 Span 加起来够不够，不够就什么都不改
+    size_t need = k - span->n_;
+    size_t have = 0;
+    for (PAGE_ID id = span->page_id_ + span->n_; have < need; ) {
+        if (id_span_map_.get_tag(id) != tag()) {
+            return false;
+        }
+        Span* next = id_span_map_.get(id);
+        if (next == nullptr || next->is_used_) {
+            return false;
+        }
+        have += next->n_;
+        id += next->n_;
+    }
+    while (span->n_ < k) {
+        PAGE_ID id = span->page_id_ + span->n_;
+        Span* next = id_span_map_.get(id);
+        size_t take = std::min(next->n_, k - span->n_);
+        erase_free_span(next);
+        // 被吞掉的页在第一次访问时由内核重新分配
+        size_t returned = returned_share(next, take);
+        returned_pages_ -= returned;
+        next->returned_ -= returned;
+        if (take < next->n_) {
+            // 剩下的部分挂回去
+            next->page_id_ += take;
+            next->n_ -= take;
+            insert_free_span(next);
+            id_span_map_.set(next->page_id_, next);
+            id_span_map_.set(next->page_id_ + next->n_ - 1, next);
+        } else {
+            span_pool_.Delete(next);
+        }
+        for (PAGE_ID i = 0; i < take; ++i) {
+            id_span_map_.set(id + i, span);
+        }
+        span->n_ += take;
+    }
+    return true;
+}
+
+bool PageHeap::remap_span(Span* span, size_t k) {
+    assert(span->is_used_ && k > 0);
+    void* old_ptr = (void*)(span->page_id_ << PAGE_SHIFT);
+    // 在 HugeTLB 大页上或者地址空间不够时会失败，由调用方拷贝
+    void* ptr = mremap(old_ptr, span->n_ << PAGE_SHIFT, k << PAGE_SHIFT, MREMAP_MAYMOVE);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    // 原来的地址已经不属于内存池了，和 munmap 一样把映射清掉
+    for (PAGE_ID i = 0; i < span->n_; ++i) {
+        id_span_map_.set(span->page_id_ + i, nullptr);
+    }
+    id_span_map_.set_tag(span->page_id_, span->n_, 0);
+    system_pages_ -= span->n_;
+    // 新的地址按新申请的内存登记到这个分片
+    NumaTopology::get_instance()->bind(ptr, k << PAGE_SHIFT, (tag() - 1) % NumaTopology::get_instance()->nodes());
+    span->page_id_ = (PAGE_ID)ptr >> PAGE_SHIFT;
+    span->n_ = k;
+    system_pages_ += k;
+    id_span_map_.ensure(span->page_id_, span->n_);
+    id_span_map_.set_tag(span->page_id_, span->n_, tag());
+    for (PAGE_ID i = 0; i < span->n_; ++i) {
+        id_span_map_.set(span->page_id_ + i, span);
+    }
+    return true;
+}
+
+bool PageHeap::can_merge(Span* span, Span* neighbor, bool returned_only) {
+    // 物理内存还在的和已经还给操作系统的 Span 照样合并，各自还回去的页数加起来，否则回收几轮以后空闲内存会被切成越来越碎的小段
+    if (returned_only) {
+        // 刚还给操作系统的 Span 只和同样全部还回去的邻居合并，不受下面 128 页的限制，反正都要重新分配物理页
+        return neighbor->returned_ == neighbor->n_;
+    }
+    // 两个都不超过 128 页时，合并出超过 128 页的 Span 没必要，留给小的申请使用
+    // 只要有一个是大 Span，就合并成更大的 Span，从大 Span 中切出去的页还回来时可以重新拼起来
+    return span->n_ + neighbor->n_ <= NPAGES - 1 || span->n_ >= NPAGES || neighbor->n_ >= NPAGES;
+}
+
+void PageHeap::insert_free_span(Span* span) {
+    if (span->n_ >= NPAGES) {
+        // 大 Span 在组内按 (页数, 页号) 排序，页数相同时优先使用低地址
+        SpanList& list = large_list_[large_bin(span->n_)];
+        Span* pos = list.begin();
+        while (pos != list.end() && (pos->n_ < span->n_ || (pos->n_ == span->n_ && pos->page_id_ < span->page_id_))) {
+            pos = pos->next_;
+        }
+        list.insert(pos, span);
+        large_bins_ |= 1u << large_bin(span->n_);
+        large_free_pages_ += span->n_;
+        return;
+    }
+    // 全部还给操作系统的放在后面，物理内存还在（哪怕只有一部分）的放在前面
+    if (span->returned_ == span->n_) {
+        span_list_[span->n_].push_back(span);
+    } else {
+        span_list_[span->n_].push_front(span);
+    }
+    bucket_bits_[span->n_ / 64] |= 1ull << (span->n_ % 64);
+}
+
+void PageHeap::erase_free_span(Span* span) {
+    if (span->n_ >= NPAGES) {
+        size_t bin = large_bin(span->n_);
+        large_list_[bin].erase(span);
+        if (large_list_[bin].empty()) {
+            large_bins_ &= ~(1u << bin);
+        }
+        large_free_pages_ -= span->n_;
+        return;
+    }
+    span_list_[span->n_].erase(span);
+    if (span_list_[span->n_].empty()) {
+        bucket_bits_[span->n_ / 64] &= ~(1ull << (span->n_ % 64));
+    }
+}
+
+void PageHeap::mark_used(Span* span) {
+    span->is_used_ = true;
+    // 物理页会在第一次访问时由内核重新分配
+    returned_pages_ -= span->returned_;
+    span->returned_ = 0;
+    // 建立页号和 Span* 的映射，方便 CentralCache 回收小块内存时，查找对应的 Span
+    // 每一页都建立映射，切好的小对象可能落在 Span 的任何一页上；对齐申请的 Span 由 take_aligned_span 切掉头部，用户地址就是第一页
+    for (PAGE_ID i = 0; i < span->n_; ++i) {
+        id_span_map_.set(span->page_id_ + i, span);
+    }
+}
+
+size_t PageHeap::release_idle_spans(size_t age_ms) {
+    size_t now = now_ms();
+    size_t released = 0;
+    for (size_t i = 1; i < NPAGES; ++i) {
+        // 每个桶里全部还给操作系统的 Span 都在后面，遇到第一个就可以停了
+        Span* it = span_list_[i].begin();
+        while (it != span_list_[i].end() && it->returned_ < it->n_) {
+            Span* next = it->next_;
+            // 合并只会吞掉全部还回去的邻居，next 是其中之一时它也是这一轮要看的最后一个
+            bool last = next == span_list_[i].end() || next->returned_ == next->n_;
+            if (now - it->free_time_ >= age_ms) {
+                size_t n = it->n_ - it->returned_;
+                erase_free_span(it);
+                if (release_span(it, now)) {
+                    released += n;
+                    // 小 Span 之间因为 128 页的限制没有合并，都还回去以后拼成一个，之后可以整段切给大的申请
+                    merge_neighbors(it, true);
+                }
+                insert_free_span(it);
+                id_span_map_.set(it->page_id_, it);
+                id_span_map_.set(it->page_id_ + it->n_ - 1, it);
+            }
+            if (last) {
+                break;
+            }
+            it = next;
+        }
+    }
+    // 大 Span 按大小排序，需要全部检查一遍；大 Span 释放时已经和所有空闲的邻居合并过，这里不需要再合并
+    for (size_t i = 0; i < LARGE_BINS; ++i) {
+        for (Span* it = large_list_[i].begin(); it != large_list_[i].end(); it = it->next_) {
+            if (it->returned_ < it->n_ && now - it->free_time_ >= age_ms) {
+                size_t n = it->n_ - it->returned_;
+                if (release_span(it, now)) {
+                    released += n;
+                }
+            }
+        }
+    }
+    return released;
+}
+
+bool PageHeap::release_span(Span* span, size_t now) {
+    // 已经还回去的页再 madvise 一次没有影响，整个 Span 一起还
+    if (!system_release((void*)(span->page_id_ << PAGE_SHIFT), span->n_ << PAGE_SHIFT)) {
+        // 还不回去（比如在 HugeTLB 大页上）就当作刚释放的，下一轮不再重复尝试
+        span->free_time_ = now;
+        return false;
+    }
+    returned_pages_ += span->n_ - span->returned_;
+    span->returned_ = span->n_;
+    return true;
+}
+
+void PageHeap::collect_stats(PoolStats& stats) {
+    size_t free_pages = 0;
+    for (size_t i = 1; i < NPAGES; ++i) {
+        for (Span* it = span_list_[i].begin(); it != span_list_[i].end(); it = it->next_) {
+            free_pages += it->n_;
+        }
+    }
+    free_pages += large_free_pages_;
+    free_pages -= returned_pages_;
+    stats.system_bytes += system_pages_ << PAGE_SHIFT;
+    stats.free_bytes += free_pages << PAGE_SHIFT;
+    stats.returned_bytes += returned_pages_ << PAGE_SHIFT;
+    stats.metadata_bytes += span_pool_.stats().resident_bytes;
+    stats.in_use_bytes += (system_pages_ - free_pages - returned_pages_) << PAGE_SHIFT;
+}
+
+bool PageHeap::check() {
+    size_t large_pages = 0;
+    size_t returned_pages = 0;
+    auto valid = [&](Span* span) {
+        if (span->is_used_ || id_span_map_.get(span->page_id_) != span || id_span_map_.get(span->page_id_ + span->n_ - 1) != span) {
+            return false;
+        }
+        // 合并时不能跨过分片的边界
+        for (PAGE_ID i = 0; i < span->n_; ++i) {
+            if (id_span_map_.get_tag(span->page_id_ + i) != tag()) {
+                return false;
+            }
+        }
+        if (span->returned_ > span->n_) {
+            return false;
+        }
+        returned_pages += span->returned_;
+        return true;
+    };
+    for (size_t i = 1; i < NPAGES; ++i) {
+        if (span_list_[i].empty() == ((bucket_bits_[i / 64] >> (i % 64)) & 1)) {
+            return false;
+        }
+        for (Span* it = span_list_[i].begin(); it != span_list_[i].end(); it = it->next_) {
+            if (it->n_ != i || !valid(it)) {
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < LARGE_BINS; ++i) {
+        for (Span* it = large_list_[i].begin(); it != large_list_[i].end(); it = it->next_) {
+            if (large_bin(it->n_) != i || !valid(it)) {
+                return false;
+            }
+            large_pages += it->n_;
+        }
+    }
+    return large_pages == large_free_pages_ && returned_pages == returned_pages_;
+}
+
+Span* PageCache::map_obj_to_span(void* obj) {
+    // 右移 12 位，找到对应的 id
+    PAGE_ID id = (PAGE_ID)obj >> PAGE_SHIFT;
+    Span* ret = PageHeap::id_span_map_.get(id);
+    assert(ret != nullptr);
+    return ret;
+}
+
+PageHeap& PageCache::local_heap(size_t node) {
+    if (tls_heap == 0) {
+        tls_heap = next_heap_.fetch_add(1, std::memory_order_relaxed) % PAGE_SHARDS + 1;
+    }
+    // 每个节点有 PAGE_SHARDS / nodes 个分片，编号为 node, node + nodes, ...
+    size_t nodes = NumaTopology::get_instance()->nodes();
+    return heaps_[node + nodes * ((tls_heap - 1) % (PAGE_SHARDS / nodes))];
+}
+
+Span* PageCache::new_span(size_t k, size_t node, size_t align) {
+    PageHeap& local = local_heap(node);
+    size_t nodes = NumaTopology::get_instance()->nodes();
+    {
+        std::lock_guard<std::mutex> lock(local.mtx_);
+        Span* span = local.take_span(k, align);
+        if (span != nullptr) {
+            return span;
+        }
+    }
+    // 自己的分片没有合适的空闲 Span，先去同一个节点的其他分片找，正在被别的线程使用的分片直接跳过
+    // 不去别的节点找，那里的内存对这个线程来说是远端内存
+    for (size_t i = node; i < PAGE_SHARDS; i += nodes) {
+        PageHeap& other = heaps_[i];
+        if (&other == &local) {
+            continue;
+        }
+        if (!other.mtx_.try_lock()) {
+            continue;
+        }
+        Span* span = other.take_span(k, align);
+        other.mtx_.unlock();
+        if (span != nullptr) {
+            return span;
+        }
+    }
+    // 都没有再向操作系统申请，新申请的内存属于自己的分片
+    std::lock_guard<std::mutex> lock(local.mtx_);
+    return local.new_span(k, align);
+}
+
+void PageCache::releas_span_to_page(Span* span) {
+    // Span 的页属于哪个分片，就还给哪个分片
+    PageHeap& heap = heaps_[PageHeap::id_span_map_.get_tag(span->page_id_) - 1];
+    std::lock_guard<std::mutex> lock(heap.mtx_);
+    heap.releas_span_to_page(span);
+}
+
+bool PageCache::resize_span(Span* span, size_t k) {
+    // 使用中的 Span 的页不会换分片，不加锁读标记
+    PageHeap& heap = heaps_[PageHeap::id_span_map_.get_tag(span->page_id_) - 1];
+    std::lock_guard<std::mutex> lock(heap.mtx_);
+    return heap.resize_span(span, k);
+}
+
+bool PageCache::remap_span(Span* span, size_t k) {
+    PageHeap& heap = heaps_[PageHeap::id_span_map_.get_tag(span->page_id_) - 1];
+    std::lock_guard<std::mutex> lock(heap.mtx_);
+    return heap.remap_span(span, k);
+}
+
+size_t PageCache::release_idle_spans(size_t age_ms) {
+    size_t released = 0;
+    for (size_t i = 0; i < PAGE_SHARDS; ++i) {
+        std::lock_guard<std::mutex> lock(heaps_[i].mtx_);
+        released += heaps_[i].release_idle_spans(age_ms);
+    }
+    return released;
+}
+
+void PageCache::collect_stats(PoolStats& stats) {
+    for (size_t i = 0; i < PAGE_SHARDS; ++i) {
+        std::lock_guard<std::mutex> lock(heaps_[i].mtx_);
+        heaps_[i].collect_stats(stats);
+    }
+}
+
+int PageCache::shard_of(void* ptr) {
+    return (int)PageHeap::id_span_map_.get_tag((PAGE_ID)ptr >> PAGE_SHIFT) - 1;
+}
+
+bool PageCache::check_shards() {
+    for (size_t i = 0; i < PAGE_SHARDS; ++i) {
+        std::lock_guard<std::mutex> lock(heaps_[i].mtx_);
+        if (!heaps_[i].check()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t PageCache::spans_scanned() {
+    size_t scanned = 0;
+    for (size_t i = 0; i < PAGE_SHARDS; ++i) {
+        std::lock_guard<std::mutex> lock(heaps_[i].mtx_);
+        scanned += heaps_[i].spans_scanned_;
+    }
+    return scanned;
+}
+
+void PageCache::lock_all() {
+    for (size_t i = 0; i < PAGE_SHARDS; ++i) {
+        heaps_[i].mtx_.lock();
+    }
+}
+
+void PageCache::unlock_all() {
+    for (size_t i = PAGE_SHARDS; i > 0; --i) {
+        heaps_[i - 1].mtx_.unlock();
+    }
+}
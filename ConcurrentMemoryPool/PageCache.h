@@ -1,28 +1,143 @@
 # pragma once
 
-#include <unordered_map>
 #include "Common.h"
 #include "ObjectPool.h"
+#include "PageMap.h"
+#include "Numa.h"
+#include <atomic>
+#ifdef CMPOOL_HUGE_PAGES
+#include "HugePageArena.h"
+#endif
 
+struct PoolStats;
+
+// 页堆被分成 PAGE_SHARDS 个分片，每个分片有自己的 Span 链表和锁
+// 第 i 个分片属于第 i % nodes 个 NUMA 节点，线程在自己所在节点的分片中按轮转分配一个
+// 分片之间只共享基数树，基数树的读不加锁，节点用 CAS 建立，每一页记录它属于哪个分片
+// 分片从操作系统拿来的内存永远属于这个分片，Span 释放时回到它所在页的分片，合并时也只和同一个分片的 Span 合并
+// 自己的分片没有空闲页时，先去同一个节点的其他分片找现成的 Span，都没有再向操作系统申请
+static const size_t PAGE_SHARDS = 8;
+// 至少这么多页的大对象原地变大失败时用 mremap 换到新的地址，由内核搬动页表，不拷贝内容
+static const size_t MREMAP_MIN_PAGES = ((size_t)1 << 20) >> PAGE_SHIFT;
+
+class PageCache;
+
+// 一个分片，除了 mtx_ 以外的成员都由 mtx_ 保护
+class PageHeap {
+public:
+    // 获取一个 k 页的 Span，超过 128 页的也优先从已经映射的空闲内存中找最合适的，没有就向操作系统申请
+    // align 大于 1 时 Span 的起始页号是 align 的倍数
+    Span* new_span(size_t k, size_t align = 1);
+    // 只从已有的空闲 Span 中切出 k 页，没有返回 nullptr
+    Span* take_span(size_t k, size_t align = 1);
+    // 释放空闲（use_count_ 减为 0）的 Span 回到这个分片，并合并相邻的 Span
+    void releas_span_to_page(Span* span);
+    // 原地把使用中的 Span 调整为 k 页: 缩小时尾部的页还回来，变大时吞掉后面相邻的空闲 Span，不够时返回 false 并且不做任何修改
+    bool resize_span(Span* span, size_t k);
+    // 用 mremap 把使用中的 Span 变成 k 页，地址可能改变，失败返回 false
+    bool remap_span(Span* span, size_t k);
+    // 将空闲时间达到 age_ms 毫秒的 Span 的物理内存还给操作系统，返回还回去的页数
+    size_t release_idle_spans(size_t age_ms);
+    // 把这个分片的使用情况累加到 stats 上
+    void collect_stats(PoolStats& stats);
+    // 检查这个分片的空闲 Span: 每一页都属于这个分片，首尾页映射到这个 Span，页数计数和链表一致
+    bool check();
+    std::mutex mtx_;
+private:
+    friend class PageCache;
+    // 超过 128 页的空闲 Span 按页数分组，一共 LARGE_BINS 组，能覆盖 48 位地址空间
+    static const size_t LARGE_BINS = 48 - PAGE_SHIFT - 7;
+    // 空闲的大 Span 最多保留这么多页，超过的部分直接 munmap 还给系统
+    static const size_t MAX_LARGE_FREE_PAGES = ((size_t)256 << 20) >> PAGE_SHIFT;
+    static const size_t BUCKET_WORDS = (NPAGES + 63) / 64;
+
+    // 基数树中记录的分片编号，从 1 开始，0 表示这一页不属于任何分片
+    unsigned char tag() const;
+    // 向操作系统申请 k 页并登记到基数树中
+    Span* system_span(size_t k);
+    // 空闲的 Span 挂回对应的桶，没有还给操作系统的挂在前面，申请时优先使用
+    // 超过 128 页的挂到大 Span 的分组里，组内按页数排序
+    void insert_free_span(Span* span);
+    // 把空闲的 Span 从所在的桶或者分组中取下来
+    void erase_free_span(Span* span);
+    // 从空闲的 Span 头部切出 k 页返回，剩下的部分挂回去
+    Span* split_span(Span* span, size_t k);
+    // 从空闲的 Span 中找一个不小于 k 页的并取下来，没有返回 nullptr
+    Span* find_free_span(size_t k);
+    // 从空闲的大 Span 中找不小于 k 页的最小的一个（best fit）并取下来，没有返回 nullptr
+    Span* find_large_span(size_t k);
+    // 从不小于 k + align - 1 页的空闲 Span 中切出起始页号按 align 对齐的 k 页，前后剩下的页挂回去，没有返回 nullptr
+    Span* take_aligned_span(size_t k, size_t align);
+    // 返回第一个不小于 k 的非空桶，没有返回 0
+    size_t find_nonempty_bucket(size_t k) const;
+    // 和前后相邻的空闲 Span 合并，span 不在任何链表里；returned_only 时只合并已经全部还给操作系统的邻居
+    void merge_neighbors(Span* span, bool returned_only);
+    // 两个相邻的空闲 Span 能否合并，见 merge_neighbors
+    bool can_merge(Span* span, Span* neighbor, bool returned_only);
+    // madvise 一个空闲 Span 的物理内存，成功返回 true
+    bool release_span(Span* span, size_t now);
+    // 被分配出去的 Span 如果之前还给了操作系统，更新计数，并建立每一页的映射
+    void mark_used(Span* span);
+
+    // 建立页号和地址间的映射，64 位下地址有效位为 48 位，所有分片共用
+    static PageMap3<48 - PAGE_SHIFT> id_span_map_;
+    SpanList span_list_[NPAGES];
+    unsigned long long bucket_bits_[BUCKET_WORDS] = {}; // 第 k 位为 1 表示第 k 个桶不为空
+    SpanList large_list_[LARGE_BINS]; // 超过 128 页的空闲 Span，第 i 组为 [2^(i+7), 2^(i+8)) 页
+    unsigned int large_bins_ = 0; // 第 i 位为 1 表示第 i 组不为空
+    size_t large_free_pages_ = 0; // 空闲的大 Span 的总页数
+    ObjectPool<Span> span_pool_;
+    size_t returned_pages_ = 0; // 空闲 Span 中已经还给操作系统的页数
+    size_t system_pages_ = 0; // 向操作系统申请的总页数
+    size_t spans_scanned_ = 0; // 查找空闲 Span 时检查过的 Span 个数
+#ifdef CMPOOL_HUGE_PAGES
+    HugePageArena huge_arena_; // 小对象使用的 Span 从 2MB 对齐的区域中切出来
+#endif
+};
+
+// 下面的接口自己加锁，调用方不需要持有任何 PageCache 的锁
 class PageCache {
 public:
     static PageCache* get_instance() {
         return &inst_;
     }
     // 将 PAGE_ID 映射到 Span* 上，这样可以通过页号直接找到对应的 Span* 的位置
+    // 基数树的读操作不需要加锁
     Span* map_obj_to_span(void* obj);
-    // 释放空闲（use_count_ 减为 0）的 Span 回到 Pagecache，并合并相邻的 Span
+    // 释放空闲（use_count_ 减为 0）的 Span 回到它所属的分片
     void releas_span_to_page(Span* span);
-    // 向堆申请一个 Span
-    Span* new_span(size_t k);
-    std::mutex page_mtx_;
+    // 在 Span 所属的分片中原地调整直接交给用户的 Span 的页数，见 PageHeap::resize_span
+    bool resize_span(Span* span, size_t k);
+    // 用 mremap 调整直接交给用户的 Span 的页数，见 PageHeap::remap_span
+    bool remap_span(Span* span, size_t k);
+    // 从当前线程在 node 节点上的分片获取一个 k 页的 Span，align 大于 1 时起始页号是 align 的倍数
+    Span* new_span(size_t k, size_t node, size_t align = 1);
+    // 从当前线程所在节点获取一个 k 页的 Span
+    Span* new_span(size_t k) {
+        return new_span(k, NumaTopology::get_instance()->current_node());
+    }
+    // 将所有分片中空闲时间达到 age_ms 毫秒的 Span 的物理内存还给操作系统，返回还回去的页数
+    size_t release_idle_spans(size_t age_ms);
+    // 统计页堆的使用情况
+    void collect_stats(PoolStats& stats);
+    // ptr 所在页属于的分片编号，不属于任何分片时返回 -1，用于测试
+    int shard_of(void* ptr);
+    // 逐个加锁检查所有分片，见 PageHeap::check，用于测试
+    bool check_shards();
+    // 所有分片查找空闲 Span 时一共检查过多少个 Span，用于测试
+    size_t spans_scanned();
+    // fork 前后加锁、解锁所有分片
+    void lock_all();
+    void unlock_all();
 private:
+    friend class PageHeap;
     PageCache() = default;
     PageCache(const PageCache&) = delete;
     PageCache& operator=(const PageCache&) = delete;
+    // 当前线程在 node 节点上使用的分片
+    PageHeap& local_heap(size_t node);
+
     static PageCache inst_;
-    SpanList span_list_[NPAGES];
-    ObjectPool<Span> span_pool_;
-    // 建立页号和地址间的映射
-    std::unordered_map<PAGE_ID, Span*> id_span_map_;
-};
\ No newline at end of file
+    PageHeap heaps_[PAGE_SHARDS];
+    std::atomic<unsigned int> next_heap_{0}; // 给新线程分配分片的轮转计数
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "Common.h"
+
+// 三层基数树，建立页号到 Span* 的映射，用来代替 unordered_map
+// 64 位 Linux 用户态地址有效位为 48 位，页号一共 48 - PAGE_SHIFT = 36 位，按 12/12/12 分成三层
+// 根节点直接放在对象里，中间节点和叶子节点在用到的时候才通过 system_alloc 申请
+// 节点一旦建立就不会释放，所以读操作不需要加锁:
+// 1. 某个对象还在被使用时，它所在页的映射在对象被分配出去之前就已经写好了，期间不会被修改
+// 2. 写操作（set、set_tag）只在持有这一页所属分片的锁时进行，不同分片写的是不同的页
+// 3. 多个分片可能同时 ensure，新节点通过 CAS 挂上去，失败的一方释放自己申请的节点
+// 每一页除了 Span* 之外还有一个字节的标记，PageCache 用它记录这一页属于哪个分片
+template <int BITS>
+class PageMap3 {
+private:
+    static const int INTERIOR_BITS = (BITS + 2) / 3; // 根节点和中间节点的位数
+    static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
+    static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS; // 叶子节点的位数
+    static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+    struct Node {
+        Node* ptrs[INTERIOR_LENGTH];
+    };
+    struct Leaf {
+        Span* values[LEAF_LENGTH];
+        unsigned char tags[LEAF_LENGTH];
+    };
+public:
+    // 获取页号对应的 Span*，没有建立映射的页返回 nullptr
+    Span* get(PAGE_ID id) const {
+        Leaf* leaf = find_leaf(id);
+        if (leaf == nullptr) {
+            return nullptr;
+        }
+        return __atomic_load_n(&leaf->values[id & (LEAF_LENGTH - 1)], __ATOMIC_RELAXED);
+    }
+    // 获取页号的标记，没有建立节点的页返回 0
+    unsigned char get_tag(PAGE_ID id) const {
+        Leaf* leaf = find_leaf(id);
+        if (leaf == nullptr) {
+            return 0;
+        }
+        return __atomic_load_n(&leaf->tags[id & (LEAF_LENGTH - 1)], __ATOMIC_RELAXED);
+    }
+    // 把 [start, start + n) 这些页的标记设为 tag，调用前必须先 ensure
+    void set_tag(PAGE_ID start, size_t n, unsigned char tag) {
+        for (PAGE_ID id = start; id < start + n; ++id) {
+            __atomic_store_n(&find_leaf(id)->tags[id & (LEAF_LENGTH - 1)], tag, __ATOMIC_RELAXED);
+        }
+    }
+    // 建立页号和 Span* 的映射，调用前必须先用 ensure 保证对应的节点已经存在
+    void set(PAGE_ID id, Span* span) {
+        assert((id >> BITS) == 0);
+        Leaf* leaf = find_leaf(id);
+        assert(leaf != nullptr);
+        __atomic_store_n(&leaf->values[id & (LEAF_LENGTH - 1)], span, __ATOMIC_RELAXED);
+    }
+    // 保证 [start, start + n) 这些页号所需要的中间节点和叶子节点都已经申请好
+    void ensure(PAGE_ID start, size_t n) {
+        for (PAGE_ID key = start; key <= start + n - 1;) {
+            const PAGE_ID i1 = key >> (LEAF_BITS + INTERIOR_BITS);
+            const PAGE_ID i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+            assert(i1 < (PAGE_ID)INTERIOR_LENGTH);
+            // 中间节点不存在就申请一个，mmap 出来的内存已经是 0
+            Node* node = install(&root_.ptrs[i1], sizeof(Node));
+            // 叶子节点不存在就申请一个
+            install(&node->ptrs[i2], sizeof(Leaf));
+            // 跳到下一个叶子节点所管理的第一个页号
+            key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+        }
+    }
+private:
+    static size_t node_pages(size_t bytes) {
+        return (bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+    }
+    // 页号所在的叶子节点，不存在返回 nullptr
+    Leaf* find_leaf(PAGE_ID id) const {
+        const PAGE_ID i1 = id >> (LEAF_BITS + INTERIOR_BITS);
+        const PAGE_ID i2 = (id >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        if ((id >> BITS) > 0) {
+            return nullptr;
+        }
+        Node* node = __atomic_load_n(&root_.ptrs[i1], __ATOMIC_ACQUIRE);
+        if (node == nullptr) {
+            return nullptr;
+        }
+        return reinterpret_cast<Leaf*>(__atomic_load_n(&node->ptrs[i2], __ATOMIC_ACQUIRE));
+    }
+    // slot 为空时申请一个 bytes 大小的节点挂上去，返回挂在 slot 上的节点
+    static Node* install(Node** slot, size_t bytes) {
+        Node* node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (node != nullptr) {
+            return node;
+        }
+        Node* fresh = (Node*)system_alloc(node_pages(bytes));
+        if (__atomic_compare_exchange_n(slot, &node, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return fresh;
+        }
+        // 别的分片已经挂上了一个，用它的
+        system_free(fresh, node_pages(bytes) << PAGE_SHIFT);
+        return node;
+    }
+    Node root_ = {}; // 根节点
+};
@@ -0,0 +1,38 @@
+#include "Scavenger.h"
+#include "PageCache.h"
+#include "CentralCache.h"
+#include <chrono>
+
+Scavenger Scavenger::inst_;
+
+void Scavenger::start(size_t age_ms, size_t interval_ms) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    age_ms_ = age_ms;
+    interval_ms_ = interval_ms == 0 ? 1 : interval_ms;
+    if (running_) {
+        return;
+    }
+    running_ = true;
+    // 线程分离运行，进程退出时不需要 join
+    std::thread(&Scavenger::run, this, ++generation_).detach();
+}
+
+void Scavenger::stop() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    running_ = false;
+    ++generation_;
+}
+
+void Scavenger::run(size_t generation) {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms_.load()));
+        if (generation_ != generation) {
+            return;
+        }
+        // TransferCache 中的对象会让 Span 一直处于使用状态，先还回去
+        for (size_t i = 0; i < NUMA_MAX_NODES; ++i) {
+            CentralCache::get_instance(i)->drain_transfer_cache();
+        }
+        PageCache::get_instance()->release_idle_spans(age_ms_);
+    }
+}
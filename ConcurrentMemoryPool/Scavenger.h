@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+
+// 后台回收线程，定期把在 PageCache 中空闲太久的 Span 的物理内存还给操作系统
+// 流量高峰过去之后，进程的 RSS 可以降下来
+class Scavenger {
+public:
+    static Scavenger* get_instance() {
+        return &inst_;
+    }
+    // 启动后台线程，每隔 interval_ms 毫秒检查一次，空闲超过 age_ms 毫秒的 Span 还给操作系统
+    // 已经在运行时只更新参数
+    void start(size_t age_ms, size_t interval_ms);
+    // 停止后台线程，线程在下一次醒来时退出
+    void stop();
+private:
+    Scavenger() = default;
+    Scavenger(const Scavenger&) = delete;
+    Scavenger& operator=(const Scavenger&) = delete;
+    void run(size_t generation);
+
+    static Scavenger inst_;
+    std::atomic<size_t> age_ms_{0};
+    std::atomic<size_t> interval_ms_{0};
+    std::atomic<size_t> generation_{0}; // 每次启动加一，旧的线程发现不一致就退出
+    std::atomic<bool> running_{false};
+    std::mutex mtx_;
+};
@@ -0,0 +1,74 @@
+#include "Stats.h"
+#include "ThreadCache.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+#ifdef CMPOOL_PER_CPU_CACHE
+#include "CpuCache.h"
+#endif
+#include <iomanip>
+
+void collect_stats(PoolStats& stats) {
+    stats = PoolStats();
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        stats.classes[i].size = SizeClass::bytes(i);
+    }
+    ThreadCache::collect_stats(stats);
+#ifdef CMPOOL_PER_CPU_CACHE
+    CpuCache::get_instance()->collect_stats(stats);
+#endif
+    for (size_t i = 0; i < NUMA_MAX_NODES; ++i) {
+        CentralCache::get_instance(i)->collect_stats(stats);
+    }
+    PageCache::get_instance()->collect_stats(stats);
+
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        SizeClassStats& cls = stats.classes[i];
+        // Span 中切出来的对象，除去还在各级缓存中的，就是程序正在使用的
+        size_t span_objects = cls.span_bytes / cls.size;
+        size_t cached = cls.thread_cache_objects + cls.transfer_cache_objects + cls.central_free_objects;
+        // 各部分不是同时读取的，可能出现缓存的对象比 Span 中的还多
+        cls.in_use_objects = span_objects > cached ? span_objects - cached : 0;
+        if (cls.span_bytes > 0) {
+            cls.fragmentation = 1.0 - (double)(cls.in_use_objects * cls.size) / cls.span_bytes;
+        }
+    }
+}
+
+static double to_mb(size_t bytes) {
+    return (double)bytes / (1024 * 1024);
+}
+
+void print_stats(const PoolStats& stats, std::ostream& os) {
+    std::ios::fmtflags flags = os.flags();
+    os << std::fixed << std::setprecision(1);
+    os << "------------------------------------------------\n";
+    os << "page heap: " << to_mb(stats.system_bytes) << " MB mapped, "
+       << to_mb(stats.in_use_bytes) << " MB in use, "
+       << to_mb(stats.free_bytes) << " MB free, "
+       << to_mb(stats.returned_bytes) << " MB returned to OS\n";
+    os << "thread caches: " << stats.thread_caches << ", "
+       << to_mb(stats.thread_cache_bytes) << " MB cached, "
+       << to_mb(stats.thread_cache_budget) << " MB budget\n";
+    os << "metadata: " << to_mb(stats.metadata_bytes) << " MB\n";
+    os << "------------------------------------------------\n";
+    os << std::setw(5) << "class" << std::setw(8) << "size"
+       << std::setw(12) << "allocs" << std::setw(12) << "frees"
+       << std::setw(10) << "thread" << std::setw(10) << "transfer"
+       << std::setw(10) << "central" << std::setw(10) << "in_use"
+       << std::setw(7) << "spans" << std::setw(10) << "span_KB"
+       << std::setw(7) << "frag%" << "\n";
+    // 只输出用到过的桶
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        const SizeClassStats& cls = stats.classes[i];
+        if (cls.alloc_count == 0 && cls.span_count == 0 && cls.thread_cache_objects == 0) {
+            continue;
+        }
+        os << std::setw(5) << i << std::setw(8) << cls.size
+           << std::setw(12) << cls.alloc_count << std::setw(12) << cls.free_count
+           << std::setw(10) << cls.thread_cache_objects << std::setw(10) << cls.transfer_cache_objects
+           << std::setw(10) << cls.central_free_objects << std::setw(10) << cls.in_use_objects
+           << std::setw(7) << cls.span_count << std::setw(10) << (cls.span_bytes >> 10)
+           << std::setw(7) << cls.fragmentation * 100 << "\n";
+    }
+    os.flags(flags);
+}
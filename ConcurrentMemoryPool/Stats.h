@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Common.h"
+
+// 内存池的运行时统计，通过 cmpool_get_stats()/cmpool_print_stats() 获取
+// 计数器由各个线程自己维护（ThreadCache 中的普通计数器，只用 relaxed 原子读写），快速路径上没有额外的同步
+// 收集时逐个模块加锁读取，各部分不是同一时刻的快照，数值是近似的
+
+// 每个桶（size class）的统计
+struct SizeClassStats {
+    size_t size = 0; // 对象大小
+    size_t alloc_count = 0; // 经过 ThreadCache 申请的次数，走 per-CPU 缓存的申请和释放不计入
+    size_t free_count = 0; // 经过 ThreadCache 释放的次数
+    size_t thread_cache_objects = 0; // 缓存在各个 ThreadCache（以及 per-CPU 缓存）中的对象个数
+    size_t transfer_cache_objects = 0; // 缓存在 TransferCache 中的对象个数
+    size_t central_free_objects = 0; // 还在 CentralCache 的 Span 自由链表里的对象个数
+    size_t in_use_objects = 0; // 正在被程序使用的对象个数
+    size_t span_count = 0; // CentralCache 中这个桶的 Span 个数
+    size_t span_bytes = 0; // 这些 Span 一共占用的字节数
+    double fragmentation = 0; // Span 中没有被程序使用的字节占比
+};
+
+struct PoolStats {
+    SizeClassStats classes[NFREELISTS];
+    size_t thread_caches = 0; // 当前存活的 ThreadCache 个数
+    size_t thread_cache_bytes = 0; // 所有 ThreadCache 缓存的字节数
+    size_t thread_cache_budget = 0; // 所有 ThreadCache 一共可以缓存的字节数
+    // PageCache 的页堆，system = in_use + free + returned
+    size_t system_bytes = 0; // 通过 mmap 向操作系统申请的字节数
+    size_t in_use_bytes = 0; // 交给 CentralCache 或者直接分配给大对象的字节数
+    size_t free_bytes = 0; // PageCache 中空闲、物理内存还在的字节数
+    size_t returned_bytes = 0; // PageCache 中空闲、物理内存已经还给操作系统的字节数
+    size_t metadata_bytes = 0; // Span、ThreadCache 这些内部对象的对象池占用的物理内存
+};
+
+// 从各个模块收集统计信息
+void collect_stats(PoolStats& stats);
+// 以表格的形式输出
+void print_stats(const PoolStats& stats, std::ostream& os);
@@ -1,14 +1,161 @@
 #include "ThreadCache.h"
 #include "CentralCache.h"
+#include "ObjectPool.h"
+#include "Stats.h"
+#include <pthread.h>
+
+__thread ThreadCache* pTLSThreadCache = nullptr;
+
+#ifdef CMPOOL_REMOTE_FREE
+// ThreadCache 销毁时把远程释放链表置成这个值，之后别的线程不能再往里面放
+static void* const REMOTE_CLOSED = (void*)1;
+#endif
+
+// 所有线程的 ThreadCache 都从这里申请，ObjectPool 本身不是线程安全的，需要加锁
+// 空闲的大块不还给操作系统: Span::owner_ 可能还指向已经销毁的 ThreadCache，别的线程要能读到 REMOTE_CLOSED
+static ObjectPool<ThreadCache, false> tcPool;
+static std::mutex tcPool_mtx;
+// 线程退出时通过 pthread_key 的析构函数回收 ThreadCache
+static pthread_key_t tc_key;
+static pthread_once_t tc_key_once = PTHREAD_ONCE_INIT;
+// 所有存活的 ThreadCache 组成的链表，统计时遍历
+static ThreadCache* tc_list = nullptr;
+// 已经退出的线程的申请、释放次数累加到这里
+static size_t exited_alloc_count[NFREELISTS];
+static size_t exited_free_count[NFREELISTS];
+// 还没有分给任何 ThreadCache 的预算，每个线程至少有 MIN_THREAD_CACHE_BYTES，线程多的时候可能是负数
+static std::atomic<long long> unclaimed_budget{(long long)THREAD_CACHE_BUDGET};
+static size_t total_budget = THREAD_CACHE_BUDGET; // 由 tcPool_mtx 保护
+// 链表连续超出 max_size 这么多次以后缩小 max_size
+static const size_t MAX_OVERAGES = 3;
+// 下一个被偷的 ThreadCache，由 tcPool_mtx 保护
+static ThreadCache* steal_cursor = nullptr;
+
+// 计数器只有所属线程会写，不需要原子加，relaxed 的读写保证统计线程读到的是完整的值
+static inline void relaxed_add(size_t& counter, size_t n) {
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void relaxed_sub(size_t& counter, size_t n) {
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) - n, __ATOMIC_RELAXED);
+}
+
+static void destroy_thread_cache(void* ptr) {
+    // 先置空，线程退出过程中如果还有申请，会重新创建一个
+    pTLSThreadCache = nullptr;
+    std::lock_guard<std::mutex> lock(tcPool_mtx);
+    // Delete 会调用 ~ThreadCache，把缓存的内存还给 CentralCache
+    tcPool.Delete((ThreadCache*)ptr);
+}
+
+void ThreadCache::link() {
+    next_ = tc_list;
+    if (tc_list != nullptr) {
+        tc_list->prev_ = this;
+    }
+    tc_list = this;
+}
+
+void ThreadCache::unlink() {
+    if (prev_ != nullptr) {
+        prev_->next_ = next_;
+    } else {
+        tc_list = next_;
+    }
+    if (next_ != nullptr) {
+        next_->prev_ = prev_;
+    }
+    if (steal_cursor == this) {
+        steal_cursor = next_;
+    }
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        exited_alloc_count[i] += alloc_count_[i];
+        exited_free_count[i] += free_count_[i];
+    }
+}
+
+static void create_tc_key() {
+    pthread_key_create(&tc_key, destroy_thread_cache);
+}
+
+ThreadCache* ThreadCache::create() {
+    pthread_once(&tc_key_once, create_tc_key);
+    tcPool_mtx.lock();
+    ThreadCache* tc = tcPool.New();
+    tc->link();
+    // 每个线程至少有 MIN_THREAD_CACHE_BYTES，不够时剩余的预算变成负数，别的线程扩容时只能去偷
+    tc->max_bytes_ = MIN_THREAD_CACHE_BYTES;
+    unclaimed_budget -= MIN_THREAD_CACHE_BYTES;
+    tcPool_mtx.unlock();
+    // pthread_setspecific 内部可能会调用 malloc，先设置好 TLS，避免替换 malloc 后递归创建
+    pTLSThreadCache = tc;
+    pthread_setspecific(tc_key, tc);
+    return tc;
+}
+
+void ThreadCache::lock_pool() {
+    tcPool_mtx.lock();
+}
+
+void ThreadCache::unlock_pool() {
+    tcPool_mtx.unlock();
+}
+
+void ThreadCache::collect_stats(PoolStats& stats) {
+    std::lock_guard<std::mutex> lock(tcPool_mtx);
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        stats.classes[i].alloc_count += exited_alloc_count[i];
+        stats.classes[i].free_count += exited_free_count[i];
+    }
+    stats.thread_cache_budget = total_budget;
+    stats.metadata_bytes += tcPool.stats().resident_bytes;
+    for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->next_) {
+        ++stats.thread_caches;
+        stats.thread_cache_bytes += __atomic_load_n(&tc->cached_bytes_, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < NFREELISTS; ++i) {
+            SizeClassStats& cls = stats.classes[i];
+            cls.alloc_count += __atomic_load_n(&tc->alloc_count_[i], __ATOMIC_RELAXED);
+            cls.free_count += __atomic_load_n(&tc->free_count_[i], __ATOMIC_RELAXED);
+            // 自由链表的长度由所属线程修改，这里读到的是近似值
+            cls.thread_cache_objects += tc->free_lists_[i].size();
+        }
+    }
+}
+
+void ThreadCache::set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(tcPool_mtx);
+    unclaimed_budget += (long long)bytes - (long long)total_budget;
+    total_budget = bytes;
+    // 已经分出去的上限加起来超过新的预算时，按比例缩小每个线程的上限（不低于 MIN_THREAD_CACHE_BYTES）
+    // 缓存超出新上限的线程在下一次释放时走 over_budget，剩余的预算不够扩容，只能把对象还回去
+    size_t claimed = 0;
+    for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->next_) {
+        claimed += tc->max_bytes_.load(std::memory_order_relaxed);
+    }
+    if (claimed <= bytes) {
+        return;
+    }
+    for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->next_) {
+        size_t limit = tc->max_bytes_.load(std::memory_order_relaxed);
+        size_t target = std::max(MIN_THREAD_CACHE_BYTES, (size_t)((double)limit * bytes / claimed));
+        // 所属线程可能同时从剩余的预算中扩容，只减去差值，不覆盖它加上去的部分
+        if (limit > target) {
+            tc->max_bytes_.fetch_sub(limit - target, std::memory_order_relaxed);
+            unclaimed_budget += (long long)(limit - target);
+        }
+    }
+}
 
 // 从自由链表数组的自由链表上拿取内存对象
 void* ThreadCache::Allocate(size_t size) {
     assert(size <= MAX_BYTES);
-    size_t align_size = SizeClass::round_up(size);
-    // 计算映射的哈希桶下标
+    // 计算映射的哈希桶下标，再由下标查出对齐后的字节数，两次查表即可
     size_t index = SizeClass::index(size);
+    size_t align_size = SizeClass::bytes(index);
+    relaxed_add(alloc_count_[index], 1);
     // 如果对应的自由链表桶不为空，直接从桶中取出内存块
     if (!free_lists_[index].empty()) {
+        relaxed_sub(cached_bytes_, align_size);
         return free_lists_[index].pop();
     } else { // 如果为空，则从 CentralCache 中获取内存块
         return fetch_from_central_cache(index, align_size);
@@ -16,15 +163,39 @@ void* ThreadCache::Allocate(size_t size) {
 }
 
 void* ThreadCache::fetch_from_central_cache(size_t index, size_t size) {
-    size_t batch_num = std::min(free_lists_[index].max_size(), SizeClass::num_move_size(size));
-    // 慢开始算法
-    if (free_lists_[index].max_size() == batch_num) {
-        free_lists_[index].max_size() += 1;
+    size_t num_move = SizeClass::num_move_size(size);
+    size_t batch_num = std::min(free_lists_[index].max_size(), num_move);
+    // 慢开始算法，max_size 小于一批时每次加一，之后每次加一批，按整批对齐
+    // 链表可以比一批长，Deallocate 时只还表头后面的一批，刚释放的表头留在线程里
+    size_t& max_size = free_lists_[index].max_size();
+    if (max_size < num_move) {
+        max_size += 1;
+    } else {
+        size_t len = std::min(max_size + num_move, std::max(MAX_FREE_LIST_LENGTH, num_move));
+        max_size = len - len % num_move;
     }
     void* start = nullptr;
     void* end = nullptr;
+#ifdef CMPOOL_REMOTE_FREE
+    // 先看别的线程有没有还回来这个桶的对象，有就直接用，不需要访问 CentralCache
+    void* remote = pop_remote(index);
+    if (remote != nullptr) {
+        size_t n = 1;
+        void* cur = next_obj(remote);
+        while (cur != nullptr) {
+            void* next = next_obj(cur);
+            free_lists_[index].push(cur);
+            cur = next;
+            ++n;
+        }
+        // 别的线程释放时没有经过 Deallocate，在这里计入释放次数
+        relaxed_add(free_count_[index], n);
+        relaxed_add(cached_bytes_, (n - 1) * size);
+        return remote;
+    }
+#endif
     // 向 CentralCache 申请一段内存
-    size_t actual_num = CentralCache::get_instance()->fetch_range_obj(start, end, batch_num, size);
+    size_t actual_num = CentralCache::get_instance()->fetch_range_obj(start, end, batch_num, size, this);
     assert(actual_num > 0);
     if (actual_num == 1) {
         assert(start == end);
@@ -32,6 +203,7 @@ void* ThreadCache::fetch_from_central_cache(size_t index, size_t size) {
     } else {
         // 将申请的一段内存头插入对应的自由链表
         free_lists_[index].push_range(next_obj(start), end, actual_num - 1);
+        relaxed_add(cached_bytes_, (actual_num - 1) * size);
         return start;
     }
 }
@@ -40,26 +212,153 @@ void ThreadCache::Deallocate(void* ptr, size_t size) {
     assert(ptr && size <= MAX_BYTES);
     // 找到映射的自由链表桶，将对象插入
     size_t index = SizeClass::index(size);
+    relaxed_add(free_count_[index], 1);
     free_lists_[index].push(ptr);
+    relaxed_add(cached_bytes_, SizeClass::bytes(index));
 
-    // 当自由链表下面挂着的小块内存的数量大于等于一次批量申请的小块内存的数量时，将 size() 大小的小块内存全部返回给 CentralCache 的 Span 上
+    // 当自由链表下面挂着的小块内存的数量大于等于 max_size 时，将表头后面的一批小块内存返回给 CentralCache 的 Span 上
     if (free_lists_[index].size() >= free_lists_[index].max_size()) {
         list_too_long(free_lists_[index], size);
+    } else if (cached_bytes_ > max_bytes_.load(std::memory_order_relaxed)) {
+        over_budget();
+    }
+}
+
+void ThreadCache::over_budget() {
+    // 没到单个线程的最大值时先尝试扩容，经常释放的线程可以多缓存一些
+    if (max_bytes_.load(std::memory_order_relaxed) < MAX_THREAD_CACHE_BYTES && increase_limit()) {
+        return;
+    }
+    scavenge();
+}
+
+bool ThreadCache::increase_limit() {
+    // 先从还没有分出去的预算中取
+    long long left = unclaimed_budget.load(std::memory_order_relaxed);
+    while (left >= (long long)THREAD_CACHE_STEAL_BYTES) {
+        if (unclaimed_budget.compare_exchange_weak(left, left - THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed)) {
+            max_bytes_.fetch_add(THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+            return true;
+        }
     }
+    // 预算用完了，从别的线程偷，轮流选择被偷的线程
+    std::lock_guard<std::mutex> lock(tcPool_mtx);
+    // 最多把所有线程看一遍
+    for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->next_) {
+        ThreadCache* victim = steal_cursor != nullptr ? steal_cursor : tc_list;
+        steal_cursor = victim->next_;
+        if (victim == this) {
+            continue;
+        }
+        // 只偷没有用满的部分，空闲线程缓存的对象别的线程还不回去，偷走它正在用的额度只会让总量超出预算
+        // 读到的 cached_bytes_ 可能已经过时，被偷的线程如果因此超出上限，会在下一次释放时自己还回去
+        size_t floor = std::max(MIN_THREAD_CACHE_BYTES, __atomic_load_n(&victim->cached_bytes_, __ATOMIC_RELAXED));
+        size_t limit = victim->max_bytes_.load(std::memory_order_relaxed);
+        while (limit >= floor + THREAD_CACHE_STEAL_BYTES) {
+            if (victim->max_bytes_.compare_exchange_weak(limit, limit - THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed)) {
+                max_bytes_.fetch_add(THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void ThreadCache::scavenge() {
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        FreeList& list = free_lists_[i];
+        size_t allocs = alloc_count_[i];
+        if (allocs == scavenge_alloc_count_[i]) {
+            // 这个桶这段时间没有用过，下次再用时从小批量开始
+            list.max_size() = std::max<size_t>(1, list.max_size() / 2);
+        }
+        scavenge_alloc_count_[i] = allocs;
+        // 低水位以下的对象从上次回收到现在一直躺在链表尾部，没有被用到
+        if (list.low_water() > 0) {
+            release_to_central(list, list.low_water(), SizeClass::bytes(i));
+        }
+        list.reset_low_water();
+    }
+    // 所有的桶都在频繁使用，只能把尾部的一半还回去
+    for (size_t i = 0; i < NFREELISTS && cached_bytes_ > max_bytes_.load(std::memory_order_relaxed); ++i) {
+        FreeList& list = free_lists_[i];
+        if (list.size() / 2 > 0) {
+            release_to_central(list, list.size() / 2, SizeClass::bytes(i));
+            list.reset_low_water();
+        }
+    }
+}
+
+void ThreadCache::release_to_central(FreeList& list, size_t n, size_t size) {
+    void* start = nullptr;
+    void* end = nullptr;
+    list.pop_back_range(n, start, end);
+    relaxed_sub(cached_bytes_, n * size);
+    // 从 start 到 end 的内存整批归还给中心缓存
+    CentralCache::get_instance()->release_range_obj(start, end, n, size);
 }
 
 void ThreadCache::list_too_long(FreeList& list, size_t size) {
-    // 将该段自由链表从哈希桶中切分出来
-    void* start = list.clear();
-    // 从 start 开始的内存归还给中心缓存
-    CentralCache::get_instance()->release_list_to_spans(start, size);
+    size = SizeClass::bytes(SizeClass::index(size));
+    size_t num_move = SizeClass::num_move_size(size);
+    // 只把紧跟在表头后面的一批还回去，只需要走一批的长度；刚释放的表头留在线程里，交替申请和释放时不需要每隔几次就访问 CentralCache
+    // 更早放进来的尾部由 scavenge 按低水位回收
+    size_t n = std::min(list.size(), num_move);
+    void* start = nullptr;
+    void* end = nullptr;
+    list.pop_range(n, start, end);
+    relaxed_sub(cached_bytes_, n * size);
+    CentralCache::get_instance()->release_range_obj(start, end, n, size);
+    // max_size 比一批大，又连续几次超出，说明缓存的对象用不完，缩小一批
+    if (list.max_size() > num_move) {
+        if (++list.overages() > MAX_OVERAGES) {
+            list.max_size() -= num_move;
+            list.overages() = 0;
+        }
+    }
 }
 
+#ifdef CMPOOL_REMOTE_FREE
+bool ThreadCache::push_remote(size_t index, void* obj) {
+    void* head = remote_lists_[index].load(std::memory_order_relaxed);
+    do {
+        if (head == REMOTE_CLOSED) {
+            return false;
+        }
+        next_obj(obj) = head;
+    } while (!remote_lists_[index].compare_exchange_weak(head, obj, std::memory_order_release, std::memory_order_relaxed));
+    return true;
+}
+
+void* ThreadCache::pop_remote(size_t index) {
+    if (remote_lists_[index].load(std::memory_order_relaxed) == nullptr) {
+        return nullptr;
+    }
+    return remote_lists_[index].exchange(nullptr, std::memory_order_acquire);
+}
+#endif
+
 // 线程结束之前，ThreadCache 当中可能留有一些小块内存，要将这些内存返回给 CentralCache
 ThreadCache::~ThreadCache() {
+    // 析构在 destroy_thread_cache 中进行，已经持有 tcPool_mtx
+    unlink();
+    // 预算还回去给别的线程用
+    unclaimed_budget += max_bytes_.load(std::memory_order_relaxed);
+#ifdef CMPOOL_REMOTE_FREE
+    // 先关闭远程释放链表，已经挂上来的对象放进自由链表一起还回去
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        void* cur = remote_lists_[i].exchange(REMOTE_CLOSED, std::memory_order_acquire);
+        while (cur != nullptr) {
+            void* next = next_obj(cur);
+            free_lists_[i].push(cur);
+            relaxed_add(cached_bytes_, SizeClass::bytes(i));
+            cur = next;
+        }
+    }
+#endif
     for (size_t i = 0; i < NFREELISTS; ++i) {
         if (!free_lists_[i].empty()) {
-            list_too_long(free_lists_[i], SizeClass::bytes(i));
+            release_to_central(free_lists_[i], free_lists_[i].size(), SizeClass::bytes(i));
         }
     }
 }
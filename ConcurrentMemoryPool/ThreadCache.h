@@ -1,6 +1,17 @@
 #pragma once
 
 #include "Common.h"
+#include <atomic>
+
+struct PoolStats;
+
+// 所有 ThreadCache 一共可以缓存的字节数，可以通过 cmpool_set_thread_cache_budget 修改
+static const size_t THREAD_CACHE_BUDGET = 32 * 1024 * 1024;
+// 每个 ThreadCache 的上限在 [MIN_THREAD_CACHE_BYTES, MAX_THREAD_CACHE_BYTES] 之间，创建时是最小值
+static const size_t MIN_THREAD_CACHE_BYTES = 2 * MAX_BYTES;
+static const size_t MAX_THREAD_CACHE_BYTES = 4 * 1024 * 1024;
+// 超过上限时，一次从剩余的预算中申请或者从别的线程偷走这么多
+static const size_t THREAD_CACHE_STEAL_BYTES = 64 * 1024;
 
 class ThreadCache {
 public:
@@ -9,13 +20,66 @@ public:
     void Deallocate(void* ptr, size_t size);
     // 从中心缓存获取对象
     void* fetch_from_central_cache(size_t index, size_t size);
-    // 释放对象时，链表过长时，回收内存到中心缓存
+    // 释放对象时，链表过长时，把表头后面的一批对象还给中心缓存
     void list_too_long(FreeList& list, size_t size);
     ~ThreadCache();
+    // 为当前线程创建 ThreadCache，线程退出时自动把它缓存的内存还给 CentralCache
+    static ThreadCache* create();
+    // fork 前后对 ThreadCache 对象池加锁和解锁，保证子进程中这把锁是可用的
+    static void lock_pool();
+    static void unlock_pool();
+    // 统计所有 ThreadCache 的申请、释放次数和缓存的对象个数
+    static void collect_stats(PoolStats& stats);
+    // 修改所有 ThreadCache 一共可以缓存的字节数，调小时按比例缩小每个线程的上限，已经超出的线程在下一次释放时回收
+    static void set_budget(size_t bytes);
+#ifdef CMPOOL_REMOTE_FREE
+    // 别的线程释放属于这个 ThreadCache 的对象时，挂到对应桶的远程释放链表上，ThreadCache 已经销毁时返回 false
+    bool push_remote(size_t index, void* obj);
+#endif
 private:
+    // 加入和移出存活 ThreadCache 的链表，调用方需要持有 tcPool_mtx
+    void link();
+    void unlink();
+    // 缓存的字节数超过上限时调用，先尝试提高上限，不行再把不常用的对象还给 CentralCache
+    void over_budget();
+    // 从剩余的预算或者别的线程那里把上限提高 THREAD_CACHE_STEAL_BYTES，成功返回 true
+    bool increase_limit();
+    // 把每个桶在上次回收以来一直没有用到的对象（低水位以下的部分）还给 CentralCache
+    // 没有申请过的桶把 max_size 减半，还回去以后仍然超出上限时，再把每个桶尾部的一半还回去
+    void scavenge();
+    // 把自由链表尾部的 n 个对象还给 CentralCache
+    void release_to_central(FreeList& list, size_t n, size_t size);
+#ifdef CMPOOL_REMOTE_FREE
+    // 取走别的线程释放回来的对象，没有时返回 nullptr
+    void* pop_remote(size_t index);
+#endif
     // 哈希桶
     FreeList free_lists_[NFREELISTS];
+    // 每个桶的申请和释放次数，只有所属线程写，统计时其他线程读，都使用 relaxed 原子操作
+    size_t alloc_count_[NFREELISTS] = {};
+    size_t free_count_[NFREELISTS] = {};
+    // 上次 scavenge 时每个桶的申请次数，没有变化说明这个桶这段时间没有用过
+    size_t scavenge_alloc_count_[NFREELISTS] = {};
+    size_t cached_bytes_ = 0; // 自由链表中所有对象的字节数，只有所属线程写
+    std::atomic<size_t> max_bytes_{0}; // 这个线程最多缓存的字节数，别的线程可能偷走一部分
+    // 所有存活的 ThreadCache 串成双向链表，在 tcPool_mtx 的保护下增删和遍历
+    ThreadCache* next_ = nullptr;
+    ThreadCache* prev_ = nullptr;
+#ifdef CMPOOL_REMOTE_FREE
+    // 每个桶一个无锁的多生产者单消费者链表（Treiber 栈），其他线程头插，所属线程整条取走
+    std::atomic<void*> remote_lists_[NFREELISTS] = {};
+#endif
 };
 
 // TLS thread local storage（TLS 线程本地存储）
-static __thread ThreadCache* pTLSThreadCache = nullptr;
\ No newline at end of file
+// 定义在 ThreadCache.cpp 中，所有翻译单元共用同一个变量
+// initial-exec 模型使得编译成动态库时访问 TLS 也不需要调用 __tls_get_addr
+extern __thread ThreadCache* pTLSThreadCache __attribute__((tls_model("initial-exec")));
+
+// 获取当前线程的 ThreadCache，没有就创建一个
+inline ThreadCache* get_thread_cache() {
+    if (pTLSThreadCache == nullptr) {
+        ThreadCache::create();
+    }
+    return pTLSThreadCache;
+}
\ No newline at end of file
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+
+// CentralCache 前面的一层无锁缓存，每个桶一个有界环形队列，每一格存放一整批对象（首、尾、个数）
+// 线程释放回来的一批对象原封不动地放进来，下一个来申请的线程直接整批拿走，不需要加桶锁，也不需要逐个对象查找 Span
+// 只有队列空或者满的时候才走原来基于 Span 的路径
+// 一个线程申请、另一个线程释放的生产者/消费者场景下，对象在两个线程之间整批流转，不再争抢桶锁
+// 队列使用 Dmitry Vyukov 的有界 MPMC 算法，每一格带一个序号，push/pop 各只需要一次 CAS
+
+// 每个桶最多缓存多少字节的对象
+static const size_t TRANSFER_CACHE_BYTES = 1024 * 1024;
+// 每个桶最多缓存多少批
+static const size_t TRANSFER_CACHE_SLOTS = 64;
+
+// 每个桶的队列容量，按一批最多的字节数换算，取 2 的幂方便取模，编译期计算
+struct TransferCacheCapacity {
+    constexpr TransferCacheCapacity() : capacity() {
+        for (size_t i = 0; i < NFREELISTS; ++i) {
+            size_t size = SizeClassRule::bytes(i);
+            size_t batches = TRANSFER_CACHE_BYTES / (size * SizeClassRule::num_move_size(size));
+            size_t cap = 1;
+            while (cap * 2 <= batches && cap * 2 <= TRANSFER_CACHE_SLOTS) {
+                cap *= 2;
+            }
+            capacity[i] = cap;
+        }
+    }
+
+    unsigned int capacity[NFREELISTS];
+};
+
+class TransferCache {
+public:
+    // 放入一批对象，队列满时返回 false
+    bool push(size_t index, void* start, void* end, size_t n) {
+        Ring& ring = rings_[index];
+        const size_t mask = capacity_.capacity[index] - 1;
+        size_t pos = ring.tail_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &ring.slots_[pos & mask];
+            // 这一格的序号等于 pos 说明是空的，可以写入
+            long diff = (long)(slot->seq_.load(std::memory_order_acquire) + (pos & mask)) - (long)pos;
+            if (diff == 0) {
+                if (ring.tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = ring.tail_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->start_ = start;
+        slot->end_ = end;
+        slot->n_ = n;
+        // 序号改为 pos + 1，通知消费者这一格可以读了
+        slot->seq_.store(pos + 1 - (pos & mask), std::memory_order_release);
+        return true;
+    }
+    // 取出一批对象，返回对象个数，队列空时返回 0
+    size_t pop(size_t index, void*& start, void*& end) {
+        Ring& ring = rings_[index];
+        const size_t cap = capacity_.capacity[index];
+        const size_t mask = cap - 1;
+        size_t pos = ring.head_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &ring.slots_[pos & mask];
+            // 这一格的序号等于 pos + 1 说明已经写好了，可以读
+            long diff = (long)(slot->seq_.load(std::memory_order_acquire) + (pos & mask)) - (long)(pos + 1);
+            if (diff == 0) {
+                if (ring.head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return 0;
+            } else {
+                pos = ring.head_.load(std::memory_order_relaxed);
+            }
+        }
+        start = slot->start_;
+        end = slot->end_;
+        size_t n = slot->n_;
+        // 序号改为 pos + cap，这一格在下一圈可以再写入
+        slot->seq_.store(pos + cap - (pos & mask), std::memory_order_release);
+        return n;
+    }
+    // 队列中缓存的对象个数，只用于统计，是近似值
+    size_t objects(size_t index) const {
+        const Ring& ring = rings_[index];
+        const size_t mask = capacity_.capacity[index] - 1;
+        size_t head = ring.head_.load(std::memory_order_relaxed);
+        size_t tail = ring.tail_.load(std::memory_order_relaxed);
+        size_t n = 0;
+        for (size_t pos = head; pos < tail && pos - head <= mask; ++pos) {
+            n += __atomic_load_n(&ring.slots_[pos & mask].n_, __ATOMIC_RELAXED);
+        }
+        return n;
+    }
+private:
+    // 第 i 格的序号初始值为 i，这里存的是序号减去 i，全 0 就是初始状态，不需要构造函数去初始化
+    struct Slot {
+        std::atomic<size_t> seq_{0};
+        void* start_ = nullptr;
+        void* end_ = nullptr;
+        size_t n_ = 0;
+    };
+    // 读写位置各占一个缓存行，避免生产者和消费者互相干扰
+    struct Ring {
+        alignas(64) std::atomic<size_t> head_{0}; // 下一次 pop 的位置
+        alignas(64) std::atomic<size_t> tail_{0}; // 下一次 push 的位置
+        alignas(64) Slot slots_[TRANSFER_CACHE_SLOTS];
+    };
+
+    static constexpr TransferCacheCapacity capacity_{};
+    Ring rings_[NFREELISTS];
+};
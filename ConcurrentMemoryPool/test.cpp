@@ -1,6 +1,12 @@
 #include "ConcurrentAllocate.h"
+#include "ConcurrentObjectPool.h"
+#include "Allocator.h"
 #include <atomic>
 #include <vector>
+#include <chrono>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 using namespace std;
 
@@ -8,17 +14,660 @@ const int thread_num = 2;
 
 void worker(int loop) {
     vector<void*> vec;
+    vector<size_t> sizes;
     for (size_t i = 0; i < loop; i++) {
         size_t bytes = rand() % MAX_BYTES + 1;
         vec.push_back(concurrent_allocate(bytes));
+        sizes.push_back(bytes);
     }
+    // 一半按地址释放，一半按大小释放
     for (size_t i = 0; i < loop; i++) {
-        concurrent_free(vec[i]);
+        if (i % 2 == 0) {
+            concurrent_free(vec[i]);
+        } else {
+            concurrent_free_sized(vec[i], sizes[i]);
+        }
+    }
+}
+
+// 用 perf 计数器统计 dTLB 读不命中次数，不支持时返回 -1
+static int open_dtlb_counter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// 大量小对象上随机访问，分别用 -DCMPOOL_HUGE_PAGES 和不加编译，对比 dTLB 不命中次数
+void tlb_benchmark() {
+    const size_t n = 1 << 20;
+    const size_t rounds = 1 << 22;
+    vector<void*> objs(n);
+    for (size_t i = 0; i < n; ++i) {
+        objs[i] = concurrent_allocate(128);
+    }
+    // 按随机顺序把对象串成一个环，顺着指针访问，每一步都可能落在不同的页上
+    vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    for (size_t i = n - 1; i > 0; --i) {
+        swap(order[i], order[rand() % (i + 1)]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        *(void**)objs[order[i]] = objs[order[(i + 1) % n]];
+    }
+    int fd = open_dtlb_counter();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto begin = chrono::steady_clock::now();
+    void* p = objs[order[0]];
+    for (size_t i = 0; i < rounds; ++i) {
+        p = *(void**)p;
+    }
+    auto cost = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - begin).count();
+    long long misses = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(fd);
+    }
+#ifdef CMPOOL_HUGE_PAGES
+    const char* mode = "huge pages";
+#else
+    const char* mode = "4KB pages";
+#endif
+    if (misses >= 0) {
+        printf("tlb benchmark (%s): %zu loads, %lld ms, %lld dTLB misses\n", mode, rounds, (long long)cost, misses);
+    } else {
+        printf("tlb benchmark (%s): %zu loads, %lld ms, dTLB counter unavailable\n", mode, rounds, (long long)cost);
+    }
+    if (p == nullptr) {
+        printf("unreachable\n");
+    }
+    for (size_t i = 0; i < n; ++i) {
+        concurrent_free(objs[i]);
     }
 }
 
 #include <fstream>
+// 多个线程共享一个对象池，一半对象交给下一个线程释放
+struct alignas(32) PoolNode {
+    PoolNode(size_t key, PoolNode* next) : key_(key), next_(next) {}
+    size_t key_;
+    PoolNode* next_;
+};
+
+void object_pool_worker(ConcurrentObjectPool<PoolNode>& pool, vector<PoolNode*>& handoff, std::mutex& mtx, size_t loop) {
+    vector<PoolNode*> mine;
+    for (size_t i = 0; i < loop; i++) {
+        PoolNode* node = pool.New(i, nullptr);
+        assert(((size_t)node & (alignof(PoolNode) - 1)) == 0 && node->key_ == i);
+        mine.push_back(node);
+    }
+    PoolNode* batch[100];
+    pool.NewN(batch, 100, (size_t)7, (PoolNode*)nullptr);
+    for (PoolNode* node : batch) {
+        assert(node->key_ == 7);
+    }
+    pool.DeleteN(batch, 100);
+    std::lock_guard<std::mutex> lock(mtx);
+    for (size_t i = 0; i < loop; i++) {
+        if (i % 2 == 0) {
+            pool.Delete(mine[i]);
+        } else {
+            handoff.push_back(mine[i]);
+        }
+    }
+}
+
+void test_object_pool() {
+    ConcurrentObjectPool<PoolNode> pool;
+    vector<PoolNode*> handoff;
+    std::mutex mtx;
+    thread th[thread_num];
+    for (int i = 0; i != thread_num; ++i) {
+        th[i] = thread(object_pool_worker, ref(pool), ref(handoff), ref(mtx), 10000);
+    }
+    for (int i = 0; i != thread_num; ++i) {
+        th[i].join();
+    }
+    for (PoolNode* node : handoff) {
+        pool.Delete(node);
+    }
+}
+
+// 对象全部还回来以后，大块内存的物理页要还给操作系统
+void test_object_pool_drain() {
+    ObjectPool<Span> pool;
+    vector<Span*> spans;
+    for (size_t i = 0; i < 100000; i++) {
+        spans.push_back(pool.New());
+    }
+    for (Span* span : spans) {
+        pool.Delete(span);
+    }
+    ObjectPoolStats stats = pool.stats();
+    assert(stats.live_objects == 0 && stats.released_chunks + 1 == stats.chunks);
+    pool.shrink();
+    assert(pool.stats().chunks == 0);
+}
+
+#ifdef CMPOOL_REMOTE_FREE
+// 申请对象的线程全部退出以后再由主线程释放，Span::owner_ 指向已经销毁的 ThreadCache，对象不能丢
+void test_remote_free_after_exit() {
+    const size_t threads = 64, per_thread = 1000;
+    size_t index = SizeClass::index(64);
+    size_t in_use = cmpool_get_stats().classes[index].in_use_objects;
+    vector<void*> ptrs(threads * per_thread);
+    // 所有线程都申请完才退出，ThreadCache 同时存活，占满对象池的好几个大块，退出后大块空出来
+    atomic<size_t> ready(0);
+    vector<thread> ths;
+    for (size_t t = 0; t < threads; ++t) {
+        ths.emplace_back([&ptrs, &ready, t, per_thread, threads]() {
+            for (size_t i = 0; i < per_thread; ++i) {
+                ptrs[t * per_thread + i] = concurrent_allocate(64);
+            }
+            ++ready;
+            while (ready.load() < threads) {
+                this_thread::yield();
+            }
+        });
+    }
+    for (thread& th : ths) {
+        th.join();
+    }
+    for (void* ptr : ptrs) {
+        concurrent_free(ptr);
+    }
+    assert(cmpool_get_stats().classes[index].in_use_objects == in_use);
+}
+#endif
+
+// 各种对齐数的申请，一半按地址释放，一半按大小和对齐数释放
+void test_aligned_allocate() {
+    vector<void*> ptrs;
+    vector<pair<size_t, size_t>> args;
+    for (size_t i = 0; i < 2000; i++) {
+        size_t align = (size_t)1 << (3 + rand() % 15); // 8B ~ 128KB
+        size_t size = rand() % (i % 10 == 0 ? 600 * 1024 : 4096) + 1;
+        void* ptr = concurrent_allocate_aligned(size, align);
+        assert(((size_t)ptr & (align - 1)) == 0);
+        memset(ptr, 1, size);
+        ptrs.push_back(ptr);
+        args.push_back(make_pair(size, align));
+    }
+    for (size_t i = 0; i < ptrs.size(); i++) {
+        if (i % 2 == 0) {
+            concurrent_free(ptrs[i]);
+        } else {
+            concurrent_free_aligned(ptrs[i], args[i].first, args[i].second);
+        }
+    }
+}
+
+// 每个线程申请一批各种大小的对象再全部释放，缓存在线程里
+void fill_thread_cache(size_t n) {
+    vector<void*> ptrs;
+    for (size_t i = 0; i < n; i++) {
+        ptrs.push_back(concurrent_allocate(rand() % 4096 + 1));
+    }
+    for (void* ptr : ptrs) {
+        concurrent_free(ptr);
+    }
+}
+
+// 调小预算以后，线程再释放对象时要把超出新上限的部分还回去
+void test_thread_cache_budget() {
+#ifdef CMPOOL_PER_CPU_CACHE
+    // 小对象走 per-CPU 缓存，不经过 ThreadCache
+    if (CpuCache::get_instance()->usable()) {
+        return;
+    }
+#endif
+    const size_t threads = 8, budget = 4 * 1024 * 1024;
+    atomic<size_t> filled(0), refilled(0);
+    atomic<bool> lowered(false), checked(false);
+    vector<thread> ths;
+    for (size_t t = 0; t < threads; ++t) {
+        ths.emplace_back([&]() {
+            fill_thread_cache(20000);
+            ++filled;
+            while (!lowered.load()) {
+                this_thread::yield();
+            }
+            fill_thread_cache(2000);
+            ++refilled;
+            // 统计完才退出，退出时缓存会全部还回去
+            while (!checked.load()) {
+                this_thread::yield();
+            }
+        });
+    }
+    while (filled.load() < threads) {
+        this_thread::yield();
+    }
+    size_t before = cmpool_get_stats().thread_cache_bytes;
+    cmpool_set_thread_cache_budget(budget);
+    lowered = true;
+    while (refilled.load() < threads) {
+        this_thread::yield();
+    }
+    PoolStats stats = cmpool_get_stats();
+    checked = true;
+    for (thread& th : ths) {
+        th.join();
+    }
+    cmpool_set_thread_cache_budget(THREAD_CACHE_BUDGET);
+    // 每个线程至少可以缓存 MIN_THREAD_CACHE_BYTES，主线程也算一个
+    assert(before > budget);
+    assert(stats.thread_cache_bytes <= max(budget, (threads + 1) * MIN_THREAD_CACHE_BYTES));
+}
+
+// pop_range 取下表头后面的 n 个对象，表尾跟着更新
+void test_free_list_pop_range() {
+    void* objs[10];
+    FreeList list;
+    for (size_t i = 0; i < 10; i++) {
+        list.push(&objs[i]);
+    }
+    void* start = nullptr;
+    void* end = nullptr;
+    list.pop_range(3, start, end);
+    assert(start == &objs[8] && end == &objs[6] && next_obj(end) == nullptr);
+    assert(list.size() == 7 && list.back() == &objs[0]);
+    list.pop_range(6, start, end);
+    assert(start == &objs[5] && end == &objs[0]);
+    assert(list.size() == 1 && list.back() == &objs[9]);
+    list.pop_range(1, start, end);
+    assert(start == &objs[9] && end == &objs[9] && list.empty());
+}
+
+size_t thread_cache_objects(size_t size) {
+    return cmpool_get_stats().classes[SizeClass::index(size)].thread_cache_objects;
+}
+
+// 链表长到 max_size 时只还表头后面的一批，刚释放的对象留在链表头部，之后交替申请和释放不再访问 CentralCache
+// 两次回收之间没有用过的桶，低水位以下的对象（也就是全部）要还回去
+void test_thread_cache_flush() {
+#ifdef CMPOOL_PER_CPU_CACHE
+    if (CpuCache::get_instance()->usable()) {
+        return;
+    }
+#endif
+    // 16KB 的桶一批 16 个，慢开始阶段拿到的对象比 max_size 多，全部释放时链表一定会长到 max_size，这时 max_size 已经超过一批
+    const size_t medium = 16 * 1024;
+    thread([&]() {
+        vector<void*> ptrs;
+        for (size_t i = 0; i < 200; i++) {
+            ptrs.push_back(concurrent_allocate(medium));
+        }
+        size_t base = thread_cache_objects(medium);
+        void* head = nullptr;
+        for (void* ptr : ptrs) {
+            concurrent_free(ptr);
+            size_t cached = thread_cache_objects(medium);
+            if (cached != base + 1) { // 这次释放把一批还给了 CentralCache
+                assert(cached > 0);
+                head = ptr;
+                break;
+            }
+            base = cached;
+        }
+        assert(head != nullptr);
+        PoolStats before = cmpool_get_stats();
+        for (size_t i = 0; i < 1000; i++) {
+            void* ptr = concurrent_allocate(medium);
+            assert(ptr == head);
+            concurrent_free(ptr);
+        }
+        PoolStats after = cmpool_get_stats();
+        size_t index = SizeClass::index(medium);
+        assert(after.classes[index].thread_cache_objects == before.classes[index].thread_cache_objects);
+        assert(after.classes[index].transfer_cache_objects == before.classes[index].transfer_cache_objects);
+        assert(after.classes[index].central_free_objects == before.classes[index].central_free_objects);
+    }).join();
+
+    // 预算为 0 时每个线程都只有 MIN_THREAD_CACHE_BYTES，没法扩容也偷不到，超出就回收
+    // 闲置的桶比触发回收的桶大，尾部减半从小桶开始，减掉一个 64KB 的对象就回到上限以内，只有低水位能还掉闲置的桶
+    cmpool_set_thread_cache_budget(0);
+    thread([&]() {
+        const size_t busy = 64 * 1024, big = 128 * 1024;
+        size_t base = thread_cache_objects(big);
+        void* a = concurrent_allocate(big);
+        void* b = concurrent_allocate(big);
+        concurrent_free(a);
+        concurrent_free(b);
+        assert(thread_cache_objects(big) > base);
+        for (size_t round = 0; round < 8; round++) {
+            vector<void*> ptrs;
+            for (size_t i = 0; i < 8; i++) {
+                ptrs.push_back(concurrent_allocate(busy));
+            }
+            for (void* ptr : ptrs) {
+                concurrent_free(ptr);
+            }
+        }
+        assert(thread_cache_objects(big) == base);
+    }).join();
+    cmpool_set_thread_cache_budget(THREAD_CACHE_BUDGET);
+}
+
+// 存活的对象不变，反复申请释放一批 65~128 页的大对象，每一轮之后把空闲页全部还给操作系统
+// 还回去的和刚释放的 Span 相邻时也要合并，向操作系统申请的总量不能一轮比一轮多
+void test_release_fragmentation() {
+    // 刚映射的内存和切剩下的部分按刚释放的算，十分钟以内不会被当作空闲已久的内存
+    // 按 512MB 对齐一定要向操作系统申请，对齐位置前后切剩下的页留在分片里
+    void* fresh = concurrent_allocate_aligned(4096, 512 * 1024 * 1024);
+    assert(PageCache::get_instance()->release_idle_spans(10 * 60 * 1000) == 0);
+    concurrent_free(fresh);
+    srand(1);
+    auto rand_size = []() {
+        return MAX_BYTES + (rand() % 64 + 1) * 4096;
+    };
+    vector<void*> live;
+    for (size_t i = 0; i < 50; i++) {
+        live.push_back(concurrent_allocate(rand_size()));
+    }
+    size_t mapped = 0;
+    for (size_t round = 0; round < 12; round++) {
+        vector<void*> tmp;
+        for (size_t i = 0; i < 100; i++) {
+            tmp.push_back(concurrent_allocate(rand_size()));
+        }
+        // 一半换掉存活的对象，一半直接释放
+        for (size_t i = 0; i < 50; i++) {
+            size_t j = rand() % live.size();
+            concurrent_free(live[j]);
+            live[j] = tmp[i];
+        }
+        for (size_t i = 50; i < 100; i++) {
+            concurrent_free(tmp[i]);
+        }
+        cmpool_release_free_memory();
+        size_t system_bytes = cmpool_get_stats().system_bytes;
+        if (round == 1) {
+            mapped = system_bytes;
+        } else if (round > 1) {
+            assert(system_bytes <= mapped);
+        }
+    }
+    assert(PageCache::get_instance()->check_shards());
+    for (void* ptr : live) {
+        concurrent_free(ptr);
+    }
+}
+
+// 多个线程在各自的分片上申请大小对象，一半交给下一个线程释放
+void page_shard_worker(vector<vector<void*>>& handoff, vector<std::mutex>& mtxs, size_t id, size_t loop) {
+    vector<void*> mine;
+    for (size_t i = 0; i < loop; i++) {
+        size_t size = i % 8 == 0 ? MAX_BYTES + rand() % (1024 * 1024) : rand() % MAX_BYTES + 1;
+        mine.push_back(concurrent_allocate(size));
+    }
+    size_t next = (id + 1) % handoff.size();
+    for (size_t i = 0; i < loop; i++) {
+        if (i % 2 == 0) {
+            concurrent_free(mine[i]);
+        } else {
+            std::lock_guard<std::mutex> lock(mtxs[next]);
+            handoff[next].push_back(mine[i]);
+        }
+    }
+    std::lock_guard<std::mutex> lock(mtxs[id]);
+    for (void* ptr : handoff[id]) {
+        concurrent_free(ptr);
+    }
+    handoff[id].clear();
+}
+
+// 页堆分片: 偷来的 Span 要还给它所属的分片，合并不能跨过分片，回收以后统计的总数要对得上
+void test_page_shards() {
+    // 一个线程释放一个很大的 Span 留在自己的分片里，下一个线程用的是另一个分片，自己的分片里没有这么大的空闲 Span，
+    // 只能从前一个线程的分片里偷；再由第三个线程释放，要回到原来的分片
+    const size_t big = 64 * 1024 * 1024;
+    int owner = -1;
+    thread([&]() {
+        void* ptr = concurrent_allocate(big);
+        owner = PageCache::get_instance()->shard_of(ptr);
+        concurrent_free(ptr);
+    }).join();
+    size_t system_bytes = cmpool_get_stats().system_bytes;
+    void* stolen = nullptr;
+    thread([&]() {
+        stolen = concurrent_allocate(big);
+    }).join();
+    assert(PageCache::get_instance()->shard_of(stolen) == owner);
+    assert(cmpool_get_stats().system_bytes == system_bytes);
+    thread([&]() {
+        concurrent_free(stolen);
+    }).join();
+    assert(PageCache::get_instance()->check_shards());
+
+    // 每个线程用的分片不一样，mmap 出来的地址通常相邻，相邻的空闲页可能属于不同的分片
+    // 两轮: 第二轮时第一轮交出去还没有被释放的对象由本轮释放
+    const size_t threads = 8;
+    vector<vector<void*>> handoff(threads);
+    vector<std::mutex> mtxs(threads);
+    for (size_t round = 0; round < 2; ++round) {
+        vector<thread> ths;
+        for (size_t t = 0; t < threads; ++t) {
+            ths.emplace_back(page_shard_worker, ref(handoff), ref(mtxs), t, 400);
+        }
+        for (thread& th : ths) {
+            th.join();
+        }
+    }
+    for (vector<void*>& ptrs : handoff) {
+        for (void* ptr : ptrs) {
+            concurrent_free(ptr);
+        }
+    }
+    assert(PageCache::get_instance()->check_shards());
+
+    // 全部空闲页还给操作系统以后，正在使用的页正好是 CentralCache 中的 Span
+    cmpool_release_free_memory();
+    PoolStats stats = cmpool_get_stats();
+    size_t span_bytes = 0;
+    for (size_t i = 0; i < NFREELISTS; ++i) {
+        span_bytes += stats.classes[i].span_bytes;
+    }
+    assert(stats.free_bytes == 0);
+    assert(stats.in_use_bytes == span_bytes);
+    assert(stats.system_bytes == stats.in_use_bytes + stats.returned_bytes);
+    assert(PageCache::get_instance()->check_shards());
+}
+
+// 某个节点的 CentralCache 中 index 号桶的统计
+SizeClassStats node_class_stats(size_t node, size_t index) {
+    PoolStats stats;
+    CentralCache::get_instance(node)->collect_stats(stats);
+    return stats.classes[index];
+}
+
+// 模拟两个节点: 节点 1 的线程申请、节点 0 的线程释放，Span 要回到节点 1 的 CentralCache，最后全部还给 PageCache
+void test_numa_fake_topology() {
+#ifdef CMPOOL_PER_CPU_CACHE
+    // per-CPU 缓存中的对象不会回到 CentralCache
+    if (CpuCache::get_instance()->usable()) {
+        return;
+    }
+#endif
+    cmpool_numa_fake_topology(2);
+    const size_t n = 5000, size = 200;
+    size_t index = SizeClass::index(size);
+    // 先把之前的测试留在 TransferCache 中的对象还回 Span，之后的 Span 个数只受这里的申请释放影响
+    cmpool_release_free_memory();
+    SizeClassStats node0 = node_class_stats(0, index), node1 = node_class_stats(1, index);
+    size_t in_use = cmpool_get_stats().classes[index].in_use_objects;
+    vector<void*> ptrs(n);
+    thread alloc_thread([&]() {
+        cmpool_numa_set_thread_node(1);
+        for (size_t i = 0; i < n; i++) {
+            ptrs[i] = concurrent_allocate(size);
+        }
+    });
+    alloc_thread.join();
+    // 对象都是从节点 1 的 Span 中切出来的
+    assert(node_class_stats(1, index).span_count > node1.span_count);
+    assert(node_class_stats(0, index).span_count == node0.span_count);
+    thread free_thread([&]() {
+        cmpool_numa_set_thread_node(0);
+        for (void* ptr : ptrs) {
+            concurrent_free(ptr);
+        }
+    });
+    free_thread.join();
+    // 还回来的对象按所在的 Span 放进节点 1 的 TransferCache 或者 Span，不会留在节点 0
+    SizeClassStats freed0 = node_class_stats(0, index);
+    assert(freed0.transfer_cache_objects == node0.transfer_cache_objects);
+    assert(freed0.central_free_objects == node0.central_free_objects);
+    assert(cmpool_get_stats().classes[index].in_use_objects == in_use);
+    cmpool_release_free_memory();
+    // 节点 0 没有收下任何 Span，节点 1 的 Span 全部空出来还给了 PageCache
+    assert(node_class_stats(0, index).span_count == node0.span_count);
+    assert(node_class_stats(1, index).span_count == node1.span_count);
+    assert(cmpool_get_stats().classes[index].in_use_objects == in_use);
+}
+
+// 按大于一页对齐的申请不能随着空闲 Span 变多而变慢: 不管同时有多少个，每次申请检查的空闲 Span 个数都有固定的上限
+// 对齐位置前面切剩下的页留在桶里，逐个检查的话申请 n 个要看 O(n^2) 个 Span
+size_t aligned_allocate_scans(size_t n) {
+    vector<void*> ptrs(n);
+    size_t before = PageCache::get_instance()->spans_scanned();
+    for (size_t i = 0; i < n; i++) {
+        ptrs[i] = concurrent_allocate_aligned(4096, 65536);
+    }
+    size_t scanned = PageCache::get_instance()->spans_scanned() - before;
+    for (void* ptr : ptrs) {
+        assert(((size_t)ptr & 65535) == 0);
+        concurrent_free(ptr);
+    }
+    return scanned;
+}
+
+void test_aligned_allocate_scaling() {
+    // 每次申请最多从桶里拿一个，或者在大 Span 的分组里看一个、再退到下一组拿一个
+    assert(aligned_allocate_scans(2000) <= 2 * 2000);
+    assert(aligned_allocate_scans(16000) <= 2 * 16000);
+}
+
+// 从 16 字节开始每次扩大 1.5 倍直到 16MB，再缩回去，内容不能丢
+// 至少 MREMAP_MIN_PAGES 页的大对象变大时要么原地变大，要么 mremap（原来的地址不再属于任何分片），不能退回到申请、拷贝
+// 直接交给用户的 Span 缩小时一定是原地的
+void test_reallocate() {
+    void* p = concurrent_allocate(100);
+    assert(concurrent_reallocate(p, 104) == p); // 同一个桶
+    size_t size = 100;
+    memset(p, 7, size);
+    while (size < 16 * 1024 * 1024) {
+        size_t new_size = size + size / 2;
+        void* q = concurrent_reallocate(p, new_size);
+        if (size >= (MREMAP_MIN_PAGES << PAGE_SHIFT)) {
+            assert(q == p || PageCache::get_instance()->shard_of(p) == -1);
+        }
+        p = q;
+        assert(((unsigned char*)p)[size - 1] == 7);
+        memset((char*)p + size, 7, new_size - size);
+        size = new_size;
+    }
+    while (size > 100) {
+        size /= 3;
+        assert(concurrent_reallocate(p, size) == p);
+        assert(((unsigned char*)p)[size - 1] == 7 && ((unsigned char*)p)[0] == 7);
+    }
+    concurrent_free(p);
+    // 缩小时还回去的尾部页还空着，马上再变大可以原地吞回来
+    void* big = concurrent_allocate(1024 * 1024);
+    assert(concurrent_reallocate(big, 512 * 1024) == big);
+    assert(concurrent_reallocate(big, 1024 * 1024) == big);
+    concurrent_free(big);
+}
+
+// 原地调整大小以后，堆分析器记录的也要是新的大小
+void test_reallocate_profile() {
+    const char* path = "test_reallocate.heap";
+    cmpool_heap_profiler_start(1);
+    // 新线程的抽样计数器从 0 开始，第一次申请一定会被抽中
+    thread([&]() {
+        void* big = concurrent_allocate(1024 * 1024);
+        assert(concurrent_reallocate(big, 300 * 1024) == big);
+        assert(cmpool_dump_heap_profile(path));
+        concurrent_free(big);
+    }).join();
+    cmpool_heap_profiler_stop();
+    ifstream in(path);
+    string header;
+    getline(in, header);
+    assert(header.compare(0, 25, "heap profile: 1: 307200 [") == 0);
+    remove(path);
+}
+
+// 抽中的小对象放在堆分析器的抽样区域里，不和普通对象共用 Span，各种释放方式都能删掉记录
+void test_sampled_small() {
+    const char* path = "test_sampled.heap";
+    cmpool_heap_profiler_start(1);
+    thread([&]() {
+        void* a = concurrent_allocate(64);
+        void* b = concurrent_allocate(64);
+        assert(HeapProfiler::is_sampled(a) && HeapProfiler::is_sampled(b) && a != b);
+        assert(((size_t)a & 4095) == 0);
+        memset(a, 7, 64);
+        // 抽样的小对象调整大小时换到新的槽位，内容保留
+        void* c = concurrent_reallocate(a, 100);
+        assert(HeapProfiler::is_sampled(c) && ((char*)c)[63] == 7);
+        void* d = concurrent_allocate_aligned(100, 256);
+        assert(HeapProfiler::is_sampled(d));
+        concurrent_free_sized(b, 64);
+        concurrent_free(c);
+        concurrent_free_aligned(d, 100, 256);
+        assert(cmpool_dump_heap_profile(path));
+    }).join();
+    cmpool_heap_profiler_stop();
+    ifstream in(path);
+    string header;
+    getline(in, header);
+    assert(header.compare(0, 19, "heap profile: 0: 0 ") == 0);
+    remove(path);
+    // 没有被抽中的对象不在抽样区域里
+    void* e = concurrent_allocate(64);
+    assert(!HeapProfiler::is_sampled(e));
+    concurrent_free_sized(e, 64);
+}
+
+// 标准库容器通过 cmpool::allocator 和 pool_resource 使用内存池，超过默认对齐的类型也要对齐
+struct alignas(64) CacheLine {
+    size_t value;
+};
+
+void test_stl_allocator() {
+    vector<size_t, cmpool::allocator<size_t>> vec;
+    for (size_t i = 0; i < 100000; i++) {
+        vec.push_back(i);
+    }
+    assert(vec[99999] == 99999);
+    vector<CacheLine, cmpool::allocator<CacheLine>> lines(100);
+    assert(((size_t)lines.data() & 63) == 0);
+    std::pmr::vector<CacheLine> pmr_lines(3, cmpool::get_pool_resource());
+    assert(((size_t)pmr_lines.data() & 63) == 0);
+    // 大于一页的对齐
+    void* page = cmpool::get_pool_resource()->allocate(100, 8192);
+    assert(((size_t)page & 8191) == 0);
+    cmpool::get_pool_resource()->deallocate(page, 100, 8192);
+}
+
 int main() {
+    // 页堆还是空的时候检查，之前的测试留下的空闲内存会把碎片掩盖掉
+    test_release_fragmentation();
     thread th[thread_num];
     const int loop = 10000;
     for (int i = 0; i != thread_num; ++i) {
@@ -27,6 +676,24 @@ int main() {
     for (int i = 0; i != thread_num; ++i) {
         th[i].join();
     }
+    test_object_pool();
+    test_object_pool_drain();
+#ifdef CMPOOL_REMOTE_FREE
+    test_remote_free_after_exit();
+#endif
+    test_stl_allocator();
+    test_thread_cache_budget();
+    test_free_list_pop_range();
+    test_thread_cache_flush();
+    test_aligned_allocate();
+    test_aligned_allocate_scaling();
+    test_reallocate();
+    test_reallocate_profile();
+    test_sampled_small();
+    test_page_shards();
+    // 之后的申请都按两个节点进行
+    test_numa_fake_topology();
+    tlb_benchmark();
 
     return 0;
 }
\ No newline at end of file